@@ -18,24 +18,148 @@ It's intended to serve as a basic shop calculator for school events or similar t
 #define SD_CLK 18 // SPI clock pin 
 #define SD_MISO 19 // SPI MISO pin 
 #define SD_MOSI 23 // SPI MOSI pin 
+#define SD_SPI_FREQ 20000000 // default SPI clock for the SD card in Hz (default of the SD library is only 4 MHz)
+#define SD_BLOCK_SIZE 512 // sector size of the SD card, writes are buffered into blocks of this size
+#define SD_FLUSH_WINDOW 2000 // default in ms, saves requested within this window are written to SD only once
+#define SNAPSHOT_INTERVAL 200 // journal records after which a new snapshot is written (keeps boot replay short)
+// #define SHOPCALC_DIAGNOSTICS // uncomment to run benchmarks at boot (results on serial monitor)
 
 
-// Initialize Wifi Module
-const char* ssid = "Kasse";         // SSID of th WIFI
-const char* password = "BitteGeld"; // Password for WIFI
-
 // Port 80 (Kassenseite) und Port 8080 (Konfigurationsseite)
 // Standard IP for webserver is 192.168.4.1
-WebServer server(80);        // product page
-WebServer configServer(8080); // config page
+// WebServer that can tell if a client is waiting, so the scheduler can decide before it serves
+// and that counts the response bytes and status code for the flight recorder
+class PriorityWebServer : public WebServer {
+ public:
+  size_t bytesSent = 0; // response bytes of the current request
+  int lastCode = 0; // status code of the current request
+
+  PriorityWebServer(int port) : WebServer(port) {}
+  bool hasPendingClient() {
+    return (_currentClient && _currentClient.available()) || _server.hasClient();
+  }
+
+  using WebServer::send;
+  void send(int code, const char* type = nullptr, const String& content = String()) {
+    lastCode = code;
+    bytesSent += content.length();
+    WebServer::send(code, type, content);
+  }
+  void send(int code, const char* type, const char* content) {
+    send(code, type, String(content));
+  }
+  void send(int code, const String& type, const String& content) {
+    send(code, type.c_str(), content);
+  }
+
+  using WebServer::sendContent;
+  void sendContent(const String& content) {
+    bytesSent += content.length();
+    WebServer::sendContent(content);
+  }
+  void sendContent(const char* content, size_t len) {
+    bytesSent += len;
+    WebServer::sendContent(content, len);
+  }
+};
+
+PriorityWebServer server(80);        // product page
+PriorityWebServer configServer(8080); // config page
+
+// Request scheduling: cashier taps (cart and checkout) are always served first,
+// reports and admin pages only get a limited amount of time while the shop is busy.
+#define SCHED_WINDOW 1000 // ms over which the time of each request class is counted
+#define SCHED_BUSY_WINDOW 3000 // ms after a checkout request during which the shop counts as busy
+#define SCHED_MAX_BURST 4 // checkout requests served in a row before the config server gets a turn
+
+// Flight recorder: every request and SD operation is recorded in RAM and written to /trace.bin regularly
+#define TRACE_EVENTS 512 // events kept in RAM (20 bytes each), power of two
+#define TRACE_SPILL_INTERVAL 10000 // ms between writes of the recorded events to SD
+#define TRACE_FILE_SIZE 262144 // bytes of trace.bin before it is renamed to trace.old and a new one is started
+#define TRACE_MAX_ROUTES 48 // routes with their own name in the trace
+
+// Power management: the CPU is slowed down and the loop sleeps while nobody is using the register.
+#define POWER_ACTIVE_MHZ 240 // CPU clock while requests come in
+#define POWER_IDLE_MHZ 80 // lowest CPU clock that keeps Wi-Fi running
+#define POWER_IDLE_POLL 1 // ms the loop sleeps between polls when idle
+#define POWER_BUSY_RATE 20 // requests per minute at which the CPU is never slowed down
+
+// Response compression: big pages and exports are sent gzip compressed, chunk by chunk while they are generated
+#define DEFLATE_WINDOW 2048 // bytes back a repetition is searched, power of two (RAM: 5 * window + 2 KB)
+#define DEFLATE_HASH_BITS 10 // hash table of 3-byte sequences, 2 bytes per entry
+#define DEFLATE_MAX_CHAIN 16 // earlier occurrences compared per position, more is slower and only a bit smaller
+#define DEFLATE_OUT 1024 // compressed bytes collected before they are sent as one chunk
+#define GZIP_MIN_SIZE 1460 // default for gzip_min_size: smaller bodies fit in one TCP segment and are sent as they are
 
 #define LED_PIN 2  // GPIO der Onboard-LED (meist GPIO 2)
-#define MAX_PRODUCTS 50 // max number of products in the shop
+#define MAX_PRODUCTS 50 // memory reserved for products, the limit used by the shop is max_products in config.txt
+#define MAX_SHIFTS 16 // shifts kept in RAM, the oldest closed shift is dropped when full
+#define MAX_CARTS 8 // carts of other terminals kept in RAM, the one unused the longest is dropped when full
+#define MAX_DEPOSIT_OVERRIDES 16 // products with their own deposit in config.txt
+#define MAX_DISCOUNT_RULES 12 // discount.<product or category> lines in config.txt
+#define MAX_COMBOS 8 // combo.<name> lines in config.txt
+#define MAX_COMBO_ITEMS 4 // different products in one combo
+#define MAX_PRICE_ADJUSTS 256 // compiled discounts (a category discount counts once per product)
+#define MAX_CATEGORIES 16 // product categories, shown as tabs on the product page
+#define CATEGORY_NONE 255 // category of products without category
+#define STOCK_UNTRACKED -1 // stock of products that are not counted
+#define MAX_SEARCH_ENTRIES (MAX_PRODUCTS * 4) // words of product names in the search index
+
+// every product costs about 390 bytes of RAM (carts, shifts, pricing tables), combos store product indices in 8 bits
+#if MAX_PRODUCTS > 255
+#error "MAX_PRODUCTS can be at most 255"
+#endif
 
 unsigned long previousMillis = 0;
-const long interval = 900; // blinking interval
 bool ledOn = false; // state of status led
 
+// runtime configuration, read from /config.txt at boot and when reloaded on the config page
+// the values here are the defaults for settings missing in the file
+struct DepositOverride {
+  char name[50]; // product name
+  float amount; // deposit for this product
+};
+
+// price change per unit of a product or of all products of a category
+struct DiscountRule {
+  char target[32]; // product or category name
+  float amount; // € per unit, negative for a discount
+  int minQty; // only from this many units in the cart
+  int16_t from; // minute of the day the rule starts, -1 = all day
+  int16_t to; // minute of the day the rule ends
+};
+
+// products sold together for a fixed price
+struct ComboRule {
+  char name[20]; // shown in the cart
+  float price; // price of the combo without deposit
+  char items[64]; // products, e.g. "2*Bier,Brezel"
+};
+
+struct Config {
+  char ssid[33] = "Kasse"; // SSID of the WIFI
+  char password[64] = "BitteGeld"; // Password for WIFI (empty or at least 8 chars)
+  int maxProducts = MAX_PRODUCTS; // max number of products in the shop
+  unsigned long blinkInterval = 900; // blinking interval of the status led in ms
+  float deposit = 1.0; // deposit of products with deposit
+  DepositOverride depositOverrides[MAX_DEPOSIT_OVERRIDES]; // products with a different deposit
+  int depositOverrideCount = 0;
+  DiscountRule discounts[MAX_DISCOUNT_RULES]; // pricing rules, see compilePricing
+  int discountCount = 0;
+  ComboRule combos[MAX_COMBOS]; // applied in this order
+  int comboCount = 0;
+  uint32_t sdSpiFreq = SD_SPI_FREQ; // SPI clock for the SD card in Hz
+  unsigned long flushWindow = SD_FLUSH_WINDOW; // ms, see SD_FLUSH_WINDOW
+  unsigned long powerIdleAfter = 5000; // ms without requests before the CPU is slowed down, 0 = never
+  unsigned long powerSleepAfter = 60000; // ms without requests before the loop polls only every powerSleepPoll ms
+  unsigned long powerSleepPoll = 20; // ms, longest extra delay of the first request after a quiet time
+  int lowStock = 5; // stock at which a product is shown as running low (default for new products)
+  bool gzip = true; // compress big pages and exports for clients that accept it
+  unsigned int gzipMinSize = GZIP_MIN_SIZE; // bytes a response needs before it is compressed
+} config;
+String configErrors; // problems found while reading config.txt, shown on the config page
+
+// one product, used for default products and when products are added
 struct Product {
   char name[50]; // product name max 50 chars 
   float price; // two decimal places
@@ -44,6 +168,23 @@ struct Product {
   int sold; // number of products sold (for sales overview)
 };
 
+// All products, stored column by column (structure of arrays).
+// Totals only read the numeric columns, names are only touched when a page is rendered.
+// Products are only moved or deleted with catalogMove/catalogRemove, which keep all columns in line.
+struct Catalog {
+  // hot columns, read for every cart total
+  int count[MAX_PRODUCTS]; // number of products in cart
+  float price[MAX_PRODUCTS]; // two decimal places
+  float deposit[MAX_PRODUCTS]; // deposit per unit, 0 without deposit (see buildDepositTable)
+  int totalSold[MAX_PRODUCTS]; // cumulative number sold per product
+  uint8_t category[MAX_PRODUCTS]; // index into categories, CATEGORY_NONE if none
+  int stock[MAX_PRODUCTS]; // units left, STOCK_UNTRACKED if not counted
+  int lowStock[MAX_PRODUCTS]; // stock at which the product is shown as running low
+  // cold columns
+  bool hasDeposit[MAX_PRODUCTS]; // true if product has deposit
+  char name[MAX_PRODUCTS][50]; // product name max 50 chars
+};
+
 // colors for serial monitor
 struct Colors {
   const char* red = "\033[31m"; // red
@@ -57,9 +198,50 @@ struct Colors {
 } colors;
 Colors color; // create color object
 
-Product products[MAX_PRODUCTS]; // Array for products
-int totalSold[MAX_PRODUCTS]; // cumulative number sold per product
+// shift of a cashier on one terminal, all numbers are updated with every order
+struct Shift {
+  uint32_t id; // shift number, increasing
+  char cashier[20]; // name of the cashier
+  uint32_t terminal; // IP address of the terminal the cashier is logged in on
+  bool open; // false once the shift is closed
+  float openingCash; // cash in the register when the shift was opened
+  float countedCash; // cash counted when the shift was closed
+  float revenue; // total incl. deposit
+  float deposit; // deposit included in revenue
+  int orders; // number of orders
+  int items; // number of items sold
+  int sold[MAX_PRODUCTS]; // items sold per product
+};
+
+Catalog catalog; // all products
 int productCount = 0; // max number of products in the shop
+char categories[MAX_CATEGORIES][20]; // category names
+int categoryCount = 0; // number of categories in use
+uint32_t stockVersion = 0; // increased when a product runs low or sells out, terminals poll it to refresh
+
+// Search index: every word of every product name, sorted case-insensitively,
+// so the products matching a prefix are one binary search plus the matching entries.
+struct SearchEntry {
+  uint16_t product; // product index
+  uint8_t offset; // start of the word in the product name
+};
+SearchEntry searchIndex[MAX_SEARCH_ENTRIES];
+int searchEntryCount = 0;
+uint8_t searchMatches[(MAX_PRODUCTS + 7) / 8]; // result of the last search, one bit per product
+Shift shifts[MAX_SHIFTS]; // open and recently closed shifts, oldest first
+int shiftCount = 0; // number of shifts in shifts[]
+uint32_t nextShiftId = 1; // id of the next shift
+
+// Every terminal has its own cart, like its own shift. The cart of the terminal of the current request is in
+// catalog.count (pricing, stock and the pages work on it), the carts of the other terminals are parked here.
+struct ParkedCart {
+  uint32_t terminal; // IP address
+  unsigned long lastUse; // millis() when it was parked
+  int count[MAX_PRODUCTS];
+};
+ParkedCart parkedCarts[MAX_CARTS];
+int parkedCartCount = 0;
+uint32_t cartTerminal = 0; // terminal whose cart is in catalog.count, 0: the cart from the snapshot, taken by the first terminal
 
 
 // if SD is empty, default products are loaded
@@ -77,6 +259,457 @@ Product defaultProducts[] = {
 
 const int defaultProductCount = 9; // number of default products
 
+// statistics of the SD write layer (shown on /status)
+struct SDStats {
+  unsigned long saveRequests = 0; // saves requested by handlers
+  unsigned long flushCount = 0; // files actually written to SD
+  unsigned long failedFlushes = 0; // saves and snapshots that could not be written, tried again later
+  unsigned long blocksWritten = 0; // blocks handed to the SD library
+  unsigned long bytesWritten = 0; // bytes written to SD
+  unsigned long lastFlushMicros = 0; // duration of the last file write
+  unsigned long maxFlushMicros = 0; // longest file write so far
+  unsigned long snapshotsWritten = 0; // snapshots written since boot
+  unsigned long journalRecords = 0; // journal records written since boot
+  unsigned long bootMillis = 0; // time from power-on until the servers were ready
+} sdStats;
+
+// Fast boot: the register state is stored as a binary snapshot (/snapshot.bin).
+// Every sale is appended to /journal.bin, at boot the snapshot is loaded and only the journal is replayed.
+#define SNAPSHOT_MAGIC 0x53504353 // "SCPS"
+#define SNAPSHOT_VERSION 8
+
+enum JournalType : uint8_t {
+  JOURNAL_SALE = 1, // qty of product sold (negative when an order is voided or refunded)
+  JOURNAL_ORDER = 2, // an order was completed (follows its JOURNAL_SALE records)
+  JOURNAL_VOID = 3, // an order was voided (follows the JOURNAL_SALE records reversing it)
+  JOURNAL_REFUND = 4, // items of an order were refunded, qty is the refunded total of the item
+};
+
+struct JournalRecord {
+  uint32_t seq; // sequence number, increasing with every record
+  uint16_t type; // JournalType
+  uint16_t product; // product index (item index within the order for JOURNAL_REFUND)
+  int32_t qty; // quantity
+  uint32_t shift; // id of the shift the order belongs to, 0 if no cashier was logged in
+  uint32_t order; // order id
+  float amount; // price of the sale incl. deposit
+  float deposit; // deposit included in amount
+  uint32_t check; // checksum of the fields above, detects torn writes at the end of the journal
+};
+
+// Order log: every order is appended to /orders.log (header followed by its items).
+// A sparse index in RAM (every orderLog.stride-th order) finds an order with a binary search and a scan of up to stride orders.
+// The stride doubles each time the index is full, so the scan grows with the order count (128 orders at 100,000 orders).
+#define ORDER_MAGIC 0x4F52 // "OR"
+#define ORDER_INDEX_SIZE 1024 // entries of the sparse order index (8 bytes each)
+#define ORDER_INDEX_STRIDE 16 // orders between index entries at the start, doubles whenever the index is full
+
+enum OrderStatus : uint8_t {
+  ORDER_BOOKED = 0,
+  ORDER_VOIDED = 1,
+};
+
+struct OrderHeader {
+  uint16_t magic; // ORDER_MAGIC
+  uint16_t itemCount; // OrderItem records following the header
+  uint32_t id; // order id
+  uint32_t shift; // shift the order was booked on
+  uint32_t epoch; // orderLog.epoch when the order was booked
+  uint8_t status; // OrderStatus
+  uint8_t reserved[3];
+};
+
+struct OrderItem {
+  uint16_t product; // product index
+  int16_t qty; // quantity sold
+  int16_t refunded; // quantity refunded since
+  int16_t reserved;
+  float price; // unit price when sold
+  float deposit; // unit deposit when sold
+};
+
+struct OrderIndexEntry {
+  uint32_t id; // order id
+  uint32_t offset; // position of the order header in orders.log
+};
+
+struct OrderLog {
+  uint32_t nextOrderId = 1; // id of the next order
+  uint32_t epoch = 0; // increased when product indices change or sales are reset, older orders can't be voided
+  uint32_t indexedSize = 0; // bytes of orders.log already in the index, new orders are written there
+  uint32_t lastLoggedId = 0; // id of the last order in orders.log, later orders of the journal are missing there
+  uint32_t stride = ORDER_INDEX_STRIDE; // orders between index entries
+  int indexCount = 0; // entries in index
+  OrderIndexEntry index[ORDER_INDEX_SIZE];
+} orderLog;
+
+struct SnapshotHeader {
+  uint32_t magic; // SNAPSHOT_MAGIC
+  uint16_t version; // SNAPSHOT_VERSION
+  uint16_t rowSize; // bytes per product in the snapshot (changes when columns change)
+  uint32_t lastSeq; // last journal record contained in the snapshot
+  int32_t productCount; // number of products stored
+  int32_t shiftCount; // number of shifts stored
+  uint32_t nextShiftId; // id of the next shift
+  uint32_t checksum; // checksum of the data after the header
+};
+
+// catalog columns stored in the snapshot (deposit is looked up from the config)
+#define SNAPSHOT_COLUMNS 8
+void* const snapshotColumns[SNAPSHOT_COLUMNS] = {catalog.count, catalog.price, catalog.totalSold, catalog.category, catalog.stock, catalog.lowStock, catalog.hasDeposit, catalog.name};
+const size_t snapshotColumnSize[SNAPSHOT_COLUMNS] = {sizeof(catalog.count[0]), sizeof(catalog.price[0]), sizeof(catalog.totalSold[0]), sizeof(catalog.category[0]), sizeof(catalog.stock[0]), sizeof(catalog.lowStock[0]), sizeof(catalog.hasDeposit[0]), sizeof(catalog.name[0])};
+
+// fixed size tables stored in the snapshot after the shifts, followed by the used entries of the order index
+#define SNAPSHOT_TABLES 3
+void* const snapshotTables[SNAPSHOT_TABLES] = {&categoryCount, categories, &orderLog};
+const size_t snapshotTableSize[SNAPSHOT_TABLES] = {sizeof(categoryCount), sizeof(categories), offsetof(OrderLog, index)};
+
+uint32_t journalSeq = 0; // sequence number of the last journal record
+int journalSinceSnapshot = 0; // journal records written since the last snapshot
+unsigned long snapshotFailedMillis = 0; // last failed snapshot write, loop() waits a flush window before the next try
+bool snapshotFailing = false; // the last snapshot write failed, only the first failure blinks the LED
+
+// pending saves, written to SD by flushPendingSaves() once the flush window is over
+bool salesDirty = false;
+bool productsDirty = false;
+unsigned long firstDirtyMillis = 0; // time of the oldest unsaved change
+
+
+///////////////////
+// Pricing rules //
+///////////////////
+
+// Discounts and combos from config.txt are compiled into tables per product (compilePricing).
+// The cart total is then updated on every cart change with a bounded number of steps (cartChanged):
+// the combos are applied again (MAX_COMBOS * MAX_COMBO_ITEMS) and only the changed products are priced.
+// All amounts are in cents, so the running total never drifts.
+
+struct PriceAdjust {
+  int32_t amount; // cents per unit
+  int16_t minQty; // units of the product in the cart (outside of combos) the adjustment needs
+  int16_t from; // minute of the day, -1 = all day
+  int16_t to;
+};
+
+struct CompiledCombo {
+  int32_t price; // cents
+  uint8_t itemCount;
+  uint8_t product[MAX_COMBO_ITEMS];
+  uint8_t qty[MAX_COMBO_ITEMS];
+};
+
+struct PricingTable {
+  PriceAdjust adjust[MAX_PRICE_ADJUSTS]; // grouped by product
+  uint16_t adjustStart[MAX_PRODUCTS + 1]; // adjust[adjustStart[i]] to adjust[adjustStart[i + 1] - 1] belong to product i
+  bool timed = false; // some adjustment has a time window
+  CompiledCombo combos[MAX_COMBOS];
+  int comboCount = 0;
+  int32_t price[MAX_PRODUCTS]; // list price in cents
+  int32_t deposit[MAX_PRODUCTS]; // deposit in cents
+  bool inCombo[MAX_PRODUCTS]; // product is part of a combo
+  // current cart
+  int comboApplied[MAX_COMBOS]; // how often each combo is in the cart
+  int comboUsed[MAX_PRODUCTS]; // units of each product taken by combos
+  int32_t line[MAX_PRODUCTS]; // cents for the units not in a combo
+  int32_t comboTotal = 0; // cents for the combos
+  int32_t net = 0; // cart total without deposit
+  int32_t listNet = 0; // cart total at list prices without deposit
+  int32_t depositTotal = 0;
+  int minute = -1; // minute of the day the adjustments were evaluated for
+} pricing;
+String pricingErrors; // rules that don't match any product, shown on the config page
+
+// Time of day, set by the product page (the ESP has no clock)
+struct ShopClock {
+  bool set = false;
+  uint32_t epoch = 0; // unix time when it was set
+  unsigned long setMillis = 0; // millis() when it was set
+  int tzOffset = 0; // minutes, like getTimezoneOffset() in JavaScript
+} shopClock;
+
+// local minute of the day, -1 if the time is unknown
+int minuteOfDay() {
+  if (!shopClock.set) return -1;
+  uint32_t now = shopClock.epoch + (millis() - shopClock.setMillis) / 1000;
+  long minute = (long)(now / 60) - shopClock.tzOffset;
+  return ((minute % 1440) + 1440) % 1440;
+}
+
+// "17:30" to minute of the day, -1 if invalid
+int parseMinute(String text) {
+  text.trim();
+  int colon = text.indexOf(':');
+  if (colon <= 0) return -1;
+  int hours = text.substring(0, colon).toInt();
+  int minutes = text.substring(colon + 1).toInt();
+  if (hours < 0 || hours > 24 || minutes < 0 || minutes > 59) return -1;
+  return (hours * 60 + minutes) % 1440;
+}
+
+// rules without time window always apply, rules with one only when the time is known
+bool inWindow(int from, int to, int minute) {
+  if (from < 0) return true;
+  if (minute < 0) return false;
+  return from <= to ? minute >= from && minute < to : minute >= from || minute < to; // e.g. 22:00-02:00
+}
+
+int32_t toCents(float euros) {
+  return (int32_t)floorf(euros * 100 + 0.5f);
+}
+
+bool ruleMatches(const char* target, int product) {
+  if (strcmp(target, catalog.name[product]) == 0) return true;
+  return catalog.category[product] != CATEGORY_NONE && strcmp(target, categories[catalog.category[product]]) == 0;
+}
+
+int findProductByName(String name) {
+  name.trim();
+  for (int i = 0; i < productCount; i++) {
+    if (name == catalog.name[i]) return i;
+  }
+  return -1;
+}
+
+// price of one unit with the adjustments for this many units in the cart
+int32_t unitPrice(int i, int units) {
+  int32_t price = pricing.price[i];
+  for (int a = pricing.adjustStart[i]; a < pricing.adjustStart[i + 1]; a++) {
+    const PriceAdjust& adjust = pricing.adjust[a];
+    if (units >= adjust.minQty && inWindow(adjust.from, adjust.to, pricing.minute)) price += adjust.amount;
+  }
+  return max((int32_t)0, price);
+}
+
+// price the units of a product that are not in a combo
+void updateLine(int i) {
+  int units = catalog.count[i] - pricing.comboUsed[i];
+  int32_t line = units > 0 ? units * unitPrice(i, units) : 0;
+  pricing.net += line - pricing.line[i];
+  pricing.line[i] = line;
+}
+
+// apply the combos in the order they are listed, each as often as the cart allows
+void applyCombos() {
+  static int left[MAX_PRODUCTS]; // units not taken by a combo yet
+  for (int c = 0; c < pricing.comboCount; c++) {
+    const CompiledCombo& combo = pricing.combos[c];
+    for (int k = 0; k < combo.itemCount; k++) left[combo.product[k]] = max(0, catalog.count[combo.product[k]]);
+  }
+  pricing.net -= pricing.comboTotal;
+  pricing.comboTotal = 0;
+  for (int c = 0; c < pricing.comboCount; c++) {
+    const CompiledCombo& combo = pricing.combos[c];
+    int times = INT16_MAX;
+    for (int k = 0; k < combo.itemCount; k++) times = min(times, left[combo.product[k]] / combo.qty[k]);
+    for (int k = 0; k < combo.itemCount; k++) left[combo.product[k]] -= times * combo.qty[k];
+    pricing.comboApplied[c] = times;
+    pricing.comboTotal += times * combo.price;
+  }
+  pricing.net += pricing.comboTotal;
+  // only products whose units moved in or out of combos are priced again
+  for (int c = 0; c < pricing.comboCount; c++) {
+    const CompiledCombo& combo = pricing.combos[c];
+    for (int k = 0; k < combo.itemCount; k++) {
+      int p = combo.product[k];
+      int used = max(0, catalog.count[p]) - left[p];
+      if (used != pricing.comboUsed[p]) {
+        pricing.comboUsed[p] = used;
+        updateLine(p);
+      }
+    }
+  }
+}
+
+// price the whole cart, after rules, products or the time of day changed
+void repriceCart() {
+  pricing.minute = minuteOfDay();
+  pricing.net = 0;
+  pricing.listNet = 0;
+  pricing.depositTotal = 0;
+  pricing.comboTotal = 0;
+  for (int i = 0; i < productCount; i++) {
+    pricing.comboUsed[i] = 0;
+    pricing.line[i] = 0;
+  }
+  applyCombos();
+  for (int i = 0; i < productCount; i++) {
+    updateLine(i);
+    pricing.listNet += catalog.count[i] * pricing.price[i];
+    pricing.depositTotal += catalog.count[i] * pricing.deposit[i];
+  }
+}
+
+// reprice after the cart count of product i changed by delta
+void cartChanged(int i, int delta) {
+  pricing.listNet += delta * pricing.price[i];
+  pricing.depositTotal += delta * pricing.deposit[i];
+  if (pricing.inCombo[i]) applyCombos();
+  updateLine(i);
+}
+
+// compile the rules of the config for the current products, has to be called when products or config change
+void compilePricing() {
+  pricingErrors = "";
+  for (int i = 0; i < productCount; i++) {
+    pricing.price[i] = toCents(catalog.price[i]);
+    pricing.deposit[i] = toCents(catalog.deposit[i]);
+    pricing.inCombo[i] = false;
+  }
+
+  // discounts, grouped by product so pricing a product only looks at its own
+  int n = 0;
+  bool matched[MAX_DISCOUNT_RULES] = {};
+  pricing.timed = false;
+  for (int i = 0; i < productCount; i++) {
+    pricing.adjustStart[i] = n;
+    for (int r = 0; r < config.discountCount; r++) {
+      const DiscountRule& rule = config.discounts[r];
+      if (!ruleMatches(rule.target, i)) continue;
+      matched[r] = true;
+      if (n == MAX_PRICE_ADJUSTS) {
+        pricingErrors += "Zu viele Rabatte, " + String(rule.target) + " wird nicht überall angewendet\n";
+        continue;
+      }
+      pricing.adjust[n].amount = toCents(rule.amount);
+      pricing.adjust[n].minQty = rule.minQty;
+      pricing.adjust[n].from = rule.from;
+      pricing.adjust[n].to = rule.to;
+      if (rule.from >= 0) pricing.timed = true;
+      n++;
+    }
+  }
+  pricing.adjustStart[productCount] = n;
+  for (int r = 0; r < config.discountCount; r++) {
+    if (!matched[r]) pricingErrors += "discount." + String(config.discounts[r].target) + ": Produkt oder Kategorie nicht gefunden\n";
+  }
+
+  // combos, products listed twice are merged
+  pricing.comboCount = 0;
+  for (int r = 0; r < config.comboCount; r++) {
+    const ComboRule& rule = config.combos[r];
+    CompiledCombo& combo = pricing.combos[pricing.comboCount];
+    combo.price = toCents(rule.price);
+    combo.itemCount = 0;
+    String items = rule.items;
+    bool ok = true;
+    while (ok && items.length() > 0) {
+      int comma = items.indexOf(',');
+      String item = comma < 0 ? items : items.substring(0, comma);
+      items = comma < 0 ? String("") : items.substring(comma + 1);
+      int qty = 1;
+      int star = item.indexOf('*');
+      if (star > 0) {
+        qty = item.substring(0, star).toInt();
+        item = item.substring(star + 1);
+      }
+      int product = findProductByName(item);
+      if (product < 0 || qty < 1 || qty > 255) {
+        pricingErrors += "combo." + String(rule.name) + ": " + item + " nicht gefunden\n";
+        ok = false;
+        break;
+      }
+      int k = 0;
+      while (k < combo.itemCount && combo.product[k] != product) k++;
+      if (k == combo.itemCount) {
+        if (k == MAX_COMBO_ITEMS) {
+          pricingErrors += "combo." + String(rule.name) + ": höchstens " + String(MAX_COMBO_ITEMS) + " Produkte\n";
+          ok = false;
+          break;
+        }
+        combo.product[k] = product;
+        combo.qty[k] = 0;
+        combo.itemCount++;
+      }
+      combo.qty[k] = min(255, combo.qty[k] + qty);
+    }
+    if (!ok || combo.itemCount == 0) continue;
+    for (int k = 0; k < combo.itemCount; k++) pricing.inCombo[combo.product[k]] = true;
+    pricing.comboCount++;
+  }
+
+  repriceCart();
+}
+
+// Brute force price of the cart straight from the rules in the config: one combo and one unit at a time.
+// Reference for the compiled tables (checked with SHOPCALC_DIAGNOSTICS), too slow to be used for every request.
+int32_t priceCartReference() {
+  static int left[MAX_PRODUCTS];
+  for (int i = 0; i < productCount; i++) left[i] = max(0, catalog.count[i]);
+  int minute = minuteOfDay();
+  int32_t cents = 0;
+
+  for (int r = 0; r < config.comboCount; r++) {
+    const ComboRule& rule = config.combos[r];
+    // products of the combo, one entry per listed product
+    int products[MAX_COMBO_ITEMS * 2];
+    int qty[MAX_COMBO_ITEMS * 2];
+    int count = 0;
+    bool ok = true;
+    String items = rule.items;
+    while (items.length() > 0 && count < MAX_COMBO_ITEMS * 2) {
+      int comma = items.indexOf(',');
+      String item = comma < 0 ? items : items.substring(0, comma);
+      items = comma < 0 ? String("") : items.substring(comma + 1);
+      int star = item.indexOf('*');
+      qty[count] = star > 0 ? item.substring(0, star).toInt() : 1;
+      products[count] = findProductByName(star > 0 ? item.substring(star + 1) : item);
+      if (products[count] < 0 || qty[count] < 1) ok = false;
+      count++;
+    }
+    if (!ok || count == 0) continue;
+    // take the products of one combo at a time, until one is missing
+    while (true) {
+      int taken = 0;
+      while (taken < count && left[products[taken]] >= qty[taken]) {
+        left[products[taken]] -= qty[taken];
+        taken++;
+      }
+      if (taken < count) {
+        while (taken-- > 0) left[products[taken]] += qty[taken];
+        break;
+      }
+      cents += toCents(rule.price);
+    }
+  }
+
+  for (int i = 0; i < productCount; i++) {
+    for (int unit = 0; unit < left[i]; unit++) {
+      int32_t price = toCents(catalog.price[i]);
+      for (int r = 0; r < config.discountCount; r++) {
+        const DiscountRule& rule = config.discounts[r];
+        if (ruleMatches(rule.target, i) && left[i] >= rule.minQty && inWindow(rule.from, rule.to, minute)) price += toCents(rule.amount);
+      }
+      cents += max((int32_t)0, price);
+    }
+  }
+  return cents;
+}
+
+// what each product of the cart costs without deposit, the price of a combo is split over its products by list price
+void cartLineAmounts(int32_t* paid) {
+  for (int i = 0; i < productCount; i++) paid[i] = pricing.line[i];
+  for (int c = 0; c < pricing.comboCount; c++) {
+    const CompiledCombo& combo = pricing.combos[c];
+    if (pricing.comboApplied[c] == 0) continue;
+    int32_t total = pricing.comboApplied[c] * combo.price;
+    int64_t list = 0;
+    int units = 0;
+    for (int k = 0; k < combo.itemCount; k++) {
+      list += (int64_t)combo.qty[k] * pricing.price[combo.product[k]];
+      units += combo.qty[k];
+    }
+    int32_t given = 0;
+    for (int k = 0; k < combo.itemCount; k++) {
+      int32_t share;
+      if (k == combo.itemCount - 1) share = total - given; // rounding rest
+      else if (list > 0) share = total * combo.qty[k] * (int64_t)pricing.price[combo.product[k]] / list;
+      else share = total * combo.qty[k] / units;
+      paid[combo.product[k]] += share;
+      given += share;
+    }
+  }
+}
+
 
 ///////////////////////
 // General Functions //
@@ -119,13 +752,447 @@ void error(int number) {
 }
 
 
+// look up the deposit of every product, has to be called whenever products or config change
+void buildDepositTable() {
+  for (int i = 0; i < productCount; i++) {
+    catalog.deposit[i] = 0;
+    if (!catalog.hasDeposit[i]) continue;
+    catalog.deposit[i] = config.deposit;
+    for (int j = 0; j < config.depositOverrideCount; j++) {
+      if (strcmp(config.depositOverrides[j].name, catalog.name[i]) == 0) {
+        catalog.deposit[i] = config.depositOverrides[j].amount;
+        break;
+      }
+    }
+  }
+}
+
+// move one entry of a column from position from to position to, the entries in between move up/down by one
+template <typename T>
+void moveColumnEntry(T* column, int from, int to) {
+  T entry;
+  memcpy(&entry, &column[from], sizeof(T));
+  if (from < to) memmove(&column[from], &column[from + 1], sizeof(T) * (to - from));
+  else memmove(&column[to + 1], &column[to], sizeof(T) * (from - to));
+  memcpy(&column[to], &entry, sizeof(T));
+}
+
+// move a product to another position, all catalog columns and the shift ledgers are moved together
+void catalogMove(int from, int to) {
+  if (from == to) return;
+  orderLog.epoch++; // product indices of older orders are no longer valid
+  moveColumnEntry(catalog.count, from, to);
+  moveColumnEntry(catalog.price, from, to);
+  moveColumnEntry(catalog.deposit, from, to);
+  moveColumnEntry(catalog.totalSold, from, to);
+  moveColumnEntry(catalog.category, from, to);
+  moveColumnEntry(catalog.stock, from, to);
+  moveColumnEntry(catalog.lowStock, from, to);
+  moveColumnEntry(catalog.hasDeposit, from, to);
+  moveColumnEntry(catalog.name, from, to);
+  for (int s = 0; s < shiftCount; s++) moveColumnEntry(shifts[s].sold, from, to);
+  for (int c = 0; c < parkedCartCount; c++) moveColumnEntry(parkedCarts[c].count, from, to);
+}
+
+// delete a product, the products after it move up by one
+void catalogRemove(int id) {
+  catalogMove(id, productCount - 1);
+  orderLog.epoch++;
+  int last = productCount - 1;
+  catalog.count[last] = 0;
+  catalog.price[last] = 0;
+  catalog.deposit[last] = 0;
+  catalog.totalSold[last] = 0;
+  catalog.category[last] = CATEGORY_NONE;
+  catalog.stock[last] = STOCK_UNTRACKED;
+  catalog.lowStock[last] = 0;
+  catalog.hasDeposit[last] = false;
+  catalog.name[last][0] = '\0';
+  for (int s = 0; s < shiftCount; s++) shifts[s].sold[last] = 0;
+  for (int c = 0; c < parkedCartCount; c++) parkedCarts[c].count[last] = 0;
+  productCount--;
+}
+
+// write a product into the catalog at position i (sales of the product are not touched)
+void catalogSet(int i, const Product& product) {
+  strncpy(catalog.name[i], product.name, sizeof(catalog.name[i]) - 1);
+  catalog.name[i][sizeof(catalog.name[i]) - 1] = '\0';
+  catalog.price[i] = product.price;
+  catalog.hasDeposit[i] = product.hasDeposit;
+  catalog.count[i] = product.count;
+  catalog.category[i] = CATEGORY_NONE;
+  catalog.stock[i] = STOCK_UNTRACKED;
+  catalog.lowStock[i] = config.lowStock;
+}
+
+// category index for a name, adds the category if it is new (CATEGORY_NONE for an empty name or if all are used)
+uint8_t findOrAddCategory(String name) {
+  name.trim();
+  if (name.length() == 0) return CATEGORY_NONE;
+  for (int c = 0; c < categoryCount; c++) {
+    if (name == categories[c]) return c;
+  }
+  if (categoryCount == MAX_CATEGORIES) return CATEGORY_NONE;
+  name.toCharArray(categories[categoryCount], sizeof(categories[categoryCount]));
+  return categoryCount++;
+}
+
+// drop categories no product uses anymore
+void pruneCategories() {
+  uint8_t remap[MAX_CATEGORIES];
+  int kept = 0;
+  for (int c = 0; c < categoryCount; c++) {
+    bool used = false;
+    for (int i = 0; i < productCount && !used; i++) used = catalog.category[i] == c;
+    remap[c] = used ? kept : CATEGORY_NONE;
+    if (used) {
+      if (kept != c) memcpy(categories[kept], categories[c], sizeof(categories[c]));
+      kept++;
+    }
+  }
+  for (int i = 0; i < productCount; i++) {
+    if (catalog.category[i] != CATEGORY_NONE) catalog.category[i] = remap[catalog.category[i]];
+  }
+  categoryCount = kept;
+}
+
+// compare the first n chars, ignoring upper/lower case (ASCII)
+int compareNoCase(const char* a, const char* b, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    int ca = tolower((unsigned char)a[i]);
+    int cb = tolower((unsigned char)b[i]);
+    if (ca != cb || ca == 0) return ca - cb;
+  }
+  return 0;
+}
+
+int compareSearchEntries(const void* a, const void* b) {
+  const SearchEntry* ea = (const SearchEntry*)a;
+  const SearchEntry* eb = (const SearchEntry*)b;
+  return compareNoCase(catalog.name[ea->product] + ea->offset, catalog.name[eb->product] + eb->offset, sizeof(catalog.name[0]));
+}
+
+void buildSearchIndex() {
+  searchEntryCount = 0;
+  for (int i = 0; i < productCount; i++) {
+    const char* name = catalog.name[i];
+    for (int c = 0; name[c] && searchEntryCount < MAX_SEARCH_ENTRIES; c++) {
+      if (name[c] != ' ' && (c == 0 || name[c - 1] == ' ')) {
+        searchIndex[searchEntryCount].product = i;
+        searchIndex[searchEntryCount].offset = c;
+        searchEntryCount++;
+      }
+    }
+  }
+  qsort(searchIndex, searchEntryCount, sizeof(SearchEntry), compareSearchEntries);
+}
+
+// mark all products with a word starting with prefix in searchMatches, returns the number of products found
+int searchProducts(const char* prefix) {
+  memset(searchMatches, 0, sizeof(searchMatches));
+  size_t len = strlen(prefix);
+
+  // first word that is not smaller than the prefix
+  int lo = 0;
+  int hi = searchEntryCount;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    const SearchEntry& entry = searchIndex[mid];
+    if (compareNoCase(catalog.name[entry.product] + entry.offset, prefix, len) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  // all words starting with the prefix follow it
+  int found = 0;
+  for (int i = lo; i < searchEntryCount; i++) {
+    const SearchEntry& entry = searchIndex[i];
+    if (compareNoCase(catalog.name[entry.product] + entry.offset, prefix, len) != 0) break;
+    uint8_t bit = 1 << (entry.product % 8);
+    if (!(searchMatches[entry.product / 8] & bit)) {
+      searchMatches[entry.product / 8] |= bit;
+      found++;
+    }
+  }
+  return found;
+}
+
+bool isSearchMatch(int i) {
+  return searchMatches[i / 8] & (1 << (i % 8));
+}
+
+// has to be called after products were added, renamed, moved or deleted
+void catalogChanged() {
+  pruneCategories();
+  buildDepositTable();
+  buildSearchIndex();
+  compilePricing();
+  stockVersion++; // terminals reload the product list
+}
+
+enum StockState {
+  STOCK_OK,
+  STOCK_LOW,
+  STOCK_OUT,
+};
+
+StockState stockState(int i) {
+  if (catalog.stock[i] == STOCK_UNTRACKED) return STOCK_OK;
+  if (catalog.stock[i] <= 0) return STOCK_OUT;
+  return catalog.stock[i] <= catalog.lowStock[i] ? STOCK_LOW : STOCK_OK;
+}
+
+// units of a product that can still be put in the cart
+int stockAvailable(int i) {
+  if (catalog.stock[i] == STOCK_UNTRACKED) return INT32_MAX;
+  return catalog.stock[i] - catalog.count[i];
+}
+
+// stock as shown in input fields, empty if not counted
+String stockText(int i) {
+  return catalog.stock[i] == STOCK_UNTRACKED ? String("") : String(catalog.stock[i]);
+}
+
+// find a shift by id, nullptr if it is no longer kept
+Shift* findShift(uint32_t id) {
+  for (int i = 0; i < shiftCount; i++) {
+    if (shifts[i].id == id) return &shifts[i];
+  }
+  return nullptr;
+}
+
+// open shift of a terminal, nullptr if no cashier is logged in there
+Shift* findOpenShift(uint32_t terminal) {
+  for (int i = 0; i < shiftCount; i++) {
+    if (shifts[i].open && shifts[i].terminal == terminal) return &shifts[i];
+  }
+  return nullptr;
+}
+
+// make the cart of a terminal the current one, has to be called before catalog.count is used for a request
+void selectCart(uint32_t terminal) {
+  if (terminal == cartTerminal) return;
+  if (cartTerminal != 0) {
+    bool empty = true;
+    for (int i = 0; i < productCount && empty; i++) empty = catalog.count[i] == 0;
+    if (!empty) {
+      int slot = parkedCartCount;
+      if (parkedCartCount == MAX_CARTS) { // drop the cart unused the longest
+        slot = 0;
+        for (int c = 1; c < parkedCartCount; c++) {
+          if (millis() - parkedCarts[c].lastUse > millis() - parkedCarts[slot].lastUse) slot = c;
+        }
+      } else {
+        parkedCartCount++;
+      }
+      parkedCarts[slot].terminal = cartTerminal;
+      parkedCarts[slot].lastUse = millis();
+      memcpy(parkedCarts[slot].count, catalog.count, sizeof(catalog.count));
+    }
+  }
+  memset(catalog.count, 0, sizeof(catalog.count));
+  for (int c = 0; c < parkedCartCount; c++) {
+    if (parkedCarts[c].terminal != terminal) continue;
+    memcpy(catalog.count, parkedCarts[c].count, sizeof(catalog.count));
+    parkedCarts[c] = parkedCarts[--parkedCartCount];
+    break;
+  }
+  cartTerminal = terminal;
+  repriceCart();
+}
+
+
+/////////////////////
+// Flight recorder //
+/////////////////////
+
+// File format (little endian), read by serial_reader/trace_decoder.py:
+// chunks of a TraceChunk header, routeCount route names (TRACE_ROUTE_NAME bytes each) and eventCount TraceEvents.
+#define TRACE_MAGIC 0x52544353 // "SCTR"
+#define TRACE_VERSION 2
+#define TRACE_ROUTE_NAME 24
+
+enum TraceType : uint8_t {
+  TRACE_BOOT = 1, // start of setup, the events after it belong to this boot
+  TRACE_REQUEST = 2, // id is the route, code the HTTP status
+  TRACE_SD = 3, // id is a TraceSdOp
+  TRACE_POWER = 4, // id is the new PowerState, code the CPU clock in MHz
+  TRACE_SETUP = 5, // setup finished, duration is the boot time
+};
+
+enum TraceSdOp : uint8_t {
+  SD_OP_SALES, // sales.csv
+  SD_OP_PRODUCTS, // products.csv
+  SD_OP_SNAPSHOT,
+  SD_OP_JOURNAL,
+  SD_OP_ORDER_APPEND,
+  SD_OP_ORDER_READ,
+  SD_OP_ORDER_PATCH,
+  SD_OP_TRACE, // flight recorder spill
+  SD_OP_SALES_READ, // sales.csv, at boot without snapshot
+  SD_OP_PRODUCTS_READ, // products.csv, at boot without snapshot
+  SD_OP_SNAPSHOT_READ,
+  SD_OP_JOURNAL_READ, // replay at boot
+  SD_OP_CONFIG_READ, // config.txt, at boot, on reload and for the config page
+  SD_OP_CONFIG_WRITE,
+  SD_OP_TRACE_READ, // download of the flight recorder
+};
+
+struct TraceEvent {
+  uint32_t start; // ms since boot
+  uint32_t duration; // us
+  uint32_t bytes; // bytes sent or written
+  uint32_t heap; // free heap at the end
+  uint8_t type; // TraceType
+  uint8_t id; // route, SD operation or power state
+  uint16_t code; // HTTP status
+};
+
+struct TraceChunk {
+  uint32_t magic; // TRACE_MAGIC
+  uint16_t version; // TRACE_VERSION
+  uint16_t routeCount; // route names following, 0 if unchanged since the last chunk of the file
+  uint32_t eventCount; // events following the route names
+  uint32_t dropped; // events lost since boot because the RAM buffer was full
+};
+
+struct FlightRecorder {
+  TraceEvent events[TRACE_EVENTS]; // ring buffer
+  uint32_t head = 0; // events recorded since boot, events[head % TRACE_EVENTS] is the next one
+  uint32_t spilled = 0; // events written to SD
+  uint32_t dropped = 0; // events overwritten before they were written to SD
+  unsigned long lastSpill = 0; // millis of the last write (or failed attempt)
+  uint32_t failedSpills = 0; // writes that failed, the events stay in the ring until the next try
+  bool spillFailing = false; // the last write failed, wait for TRACE_SPILL_INTERVAL even if the ring fills up
+  char routes[TRACE_MAX_ROUTES][TRACE_ROUTE_NAME]; // route names, filled in on the first request
+  uint8_t routeCount = 0;
+  bool routesChanged = true; // route names have to be written with the next chunk
+} recorder;
+
+// record an event, only a few RAM writes so it can be called on every request
+void traceEvent(TraceType type, uint8_t id, uint32_t start, uint32_t duration, uint32_t bytes, uint16_t code) {
+  TraceEvent& event = recorder.events[recorder.head & (TRACE_EVENTS - 1)];
+  event.start = start;
+  event.duration = duration;
+  event.bytes = bytes;
+  event.heap = ESP.getFreeHeap();
+  event.type = type;
+  event.id = id;
+  event.code = code;
+  recorder.head++;
+}
+
+// record an SD operation that started at start (micros)
+void traceSd(TraceSdOp op, unsigned long start, uint32_t bytes) {
+  unsigned long duration = micros() - start;
+  traceEvent(TRACE_SD, op, millis() - duration / 1000, duration, bytes, 0);
+}
+
+// id for a route, its name is set on registration or taken from the first request
+uint8_t traceRoute(const char* name = nullptr) {
+  if (recorder.routeCount == TRACE_MAX_ROUTES) return TRACE_MAX_ROUTES - 1; // last one is shared
+  uint8_t id = recorder.routeCount++;
+  recorder.routes[id][0] = '\0';
+  if (name) strncpy(recorder.routes[id], name, TRACE_ROUTE_NAME - 1);
+  return id;
+}
+
+void traceRequest(uint8_t route, PriorityWebServer& srv, uint32_t start, uint32_t duration) {
+  if (recorder.routes[route][0] == '\0') {
+    srv.uri().toCharArray(recorder.routes[route], TRACE_ROUTE_NAME);
+    recorder.routesChanged = true;
+  }
+  traceEvent(TRACE_REQUEST, route, start, duration, srv.bytesSent, srv.lastCode);
+}
+
+// Wrap a handler so its requests are recorded
+WebServer::THandlerFunction traced(PriorityWebServer& srv, void (*handler)(), const char* name = nullptr) {
+  uint8_t route = traceRoute(name);
+  return [&srv, handler, route]() {
+    srv.bytesSent = 0;
+    uint32_t startMillis = millis();
+    unsigned long start = micros();
+    handler();
+    traceRequest(route, srv, startMillis, micros() - start);
+  };
+}
+
+
 //////////////////
 // SD handeling //
 //////////////////
 
+// Buffered writer for SD files.
+// Collects the small print() calls of the save functions and passes them to the SD library
+// in whole 512 byte blocks, so a save costs a few sector writes instead of one SPI transaction per field.
+struct SDBlockWriter : public Print {
+  File file;
+  uint8_t block[SD_BLOCK_SIZE];
+  size_t used = 0; // bytes in block
+  size_t limit = SD_BLOCK_SIZE; // bytes until the next sector boundary of the file
+  size_t total = 0; // bytes written since open
+
+  bool open(const char* path, const char* mode = FILE_WRITE) {
+    file = SD.open(path, mode);
+    used = 0;
+    total = 0;
+    if (!file) return false;
+    // when appending, fill up the partially written sector first so all following blocks are aligned
+    limit = SD_BLOCK_SIZE - (file.size() % SD_BLOCK_SIZE);
+    return true;
+  }
+
+  // continue writing at position instead of the end of the file, before the first write
+  bool seek(uint32_t position) {
+    limit = SD_BLOCK_SIZE - (position % SD_BLOCK_SIZE);
+    return file.seek(position);
+  }
+
+  size_t write(uint8_t b) override {
+    return write(&b, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t len) override {
+    size_t written = 0;
+    while (written < len) {
+      size_t n = min(len - written, limit - used);
+      memcpy(block + used, data + written, n);
+      used += n;
+      written += n;
+      if (used == limit) flushBlock();
+    }
+    return written;
+  }
+
+  // hand the buffered block to the SD library
+  void flushBlock() {
+    if (used == 0) return;
+    file.write(block, used);
+    total += used;
+    sdStats.bytesWritten += used;
+    sdStats.blocksWritten++;
+    used = 0;
+    limit = SD_BLOCK_SIZE;
+  }
+
+  void close() {
+    flushBlock();
+    file.close();
+    sdStats.flushCount++;
+  }
+};
+SDBlockWriter sdWriter; // shared writer, keeps the block buffer off the stack
+
+// record how long a file write took
+void recordFlushTime(unsigned long start, TraceSdOp op, size_t bytes) {
+  sdStats.lastFlushMicros = micros() - start;
+  if (sdStats.lastFlushMicros > sdStats.maxFlushMicros) sdStats.maxFlushMicros = sdStats.lastFlushMicros;
+  traceSd(op, start, bytes);
+}
+
 // initialize SD card
 void initSD() {
-  if (!SD.begin(SD_CS)) {
+  SPI.begin(SD_CLK, SD_MISO, SD_MOSI, SD_CS);
+  if (!SD.begin(SD_CS, SPI, config.sdSpiFreq)) {
     error(1); // SD card not found
     return;
   }
@@ -153,30 +1220,34 @@ void initSD() {
   }
 }
 
-void saveSalesToSD() {
-  File file = SD.open("/sales.csv", FILE_WRITE);
-  if (!file) {
+// false if the file could not be opened, the caller decides how to report it
+bool saveSalesToSD() {
+  unsigned long start = micros();
+  if (!sdWriter.open("/sales.csv")) {
     Serial.println("[saveSalesToSD] Failed to open file for writing.");
-    error(4); // file error
-    return;
+    return false;
   }
 
   for (int i = 0; i < productCount; i++) {
-    file.print(products[i].name); file.print(',');
-    file.println(totalSold[i]);
+    sdWriter.print(catalog.name[i]); sdWriter.print(',');
+    sdWriter.println(catalog.totalSold[i]);
   }
-  file.close();
+  sdWriter.close();
+  salesDirty = false;
+  recordFlushTime(start, SD_OP_SALES, sdWriter.total);
   Serial.println(String(color.reset) + "[saveSalesToSD] Sales data saved to SD card.");
+  return true;
 }
 
 void loadSalesFromSD() {
+  unsigned long start = micros();
   File file = SD.open("/sales.csv");
   if (!file) {
     Serial.println(String(color.reset) + "[loadSalesFromSD] No sales file found. Initializing empty sales.");
     for (int i = 0; i < productCount; i++) {
-      totalSold[i] = 0;
+      catalog.totalSold[i] = 0;
     }
-    saveSalesToSD();
+    if (!saveSalesToSD()) error(4); // file error
     return;
   }
 
@@ -185,10 +1256,11 @@ void loadSalesFromSD() {
     String line = file.readStringUntil('\n');
     int comma = line.indexOf(',');
     if (comma > 0) {
-      totalSold[index] = line.substring(comma + 1).toInt();
+      catalog.totalSold[index] = line.substring(comma + 1).toInt();
       index++;
     }
   }
+  traceSd(SD_OP_SALES_READ, start, file.size());
   file.close();
   Serial.println(String(color.reset) + "[loadSalesFromSD] Sales data loaded from SD card.");
 }
@@ -209,35 +1281,41 @@ void printSDData(char* filename) {
   file.close();
 }
 
-void saveProductsToSD() {
-  File file = SD.open("/products.csv", FILE_WRITE);
-  if (!file) {
+bool saveProductsToSD() {
+  unsigned long start = micros();
+  if (!sdWriter.open("/products.csv")) {
     Serial.println("[saveProductsToSD] Failed to open file for writing.");
-    error(4); // file error
-    return;
+    return false;
   }
 
-  file.println(productCount);
+  sdWriter.println(productCount);
   for (int i = 0; i < productCount; i++) {
-    file.print(products[i].name); file.print(',');
-    file.print(products[i].price); file.print(',');
-    file.print(products[i].hasDeposit); file.print(',');
-    file.print(products[i].count); file.print(',');
-    file.println(products[i].sold);
+    sdWriter.print(catalog.name[i]); sdWriter.print(',');
+    sdWriter.print(catalog.price[i]); sdWriter.print(',');
+    sdWriter.print(catalog.hasDeposit[i]); sdWriter.print(',');
+    sdWriter.print(catalog.count[i]); sdWriter.print(',');
+    sdWriter.print(catalog.totalSold[i]); sdWriter.print(',');
+    sdWriter.print(catalog.category[i] == CATEGORY_NONE ? "" : categories[catalog.category[i]]); sdWriter.print(',');
+    sdWriter.print(stockText(i)); sdWriter.print(',');
+    sdWriter.println(catalog.lowStock[i]);
   }
-  file.close();
+  sdWriter.close();
+  productsDirty = false;
+  recordFlushTime(start, SD_OP_PRODUCTS, sdWriter.total);
   Serial.println(String(color.green) + "[saveProductsToSD] Products saved to SD card." + String(color.reset));
+  return true;
 }
 
 void loadProductsFromSD() {
+  unsigned long start = micros();
   File file = SD.open("/products.csv");
   if (!file) {
     Serial.println("[loadProductsFromSD] File not found. Using default products.");
     productCount = defaultProductCount;
     for (int i = 0; i < productCount; i++) {
-      products[i] = defaultProducts[i];
+      catalogSet(i, defaultProducts[i]);
     }
-    saveProductsToSD();
+    if (!saveProductsToSD()) error(4); // file error
     return;
   }
 
@@ -245,61 +1323,1284 @@ void loadProductsFromSD() {
   for (int i = 0; i < productCount && file.available(); i++) {
     String line = file.readStringUntil('\n');
     int idx = 0;
-    String parts[5];
-    for (int j = 0; j < 5 && idx >= 0; j++) {
+    String parts[8]; // name, price, deposit, count, sold, category, stock, low stock (missing in files of older versions)
+    for (int j = 0; j < 8; j++) {
       int next = line.indexOf(',', idx);
-      if (next == -1 && j < 4) break;
       parts[j] = line.substring(idx, (next == -1 ? line.length() : next));
+      if (next == -1) break;
       idx = next + 1;
     }
-    parts[0].toCharArray(products[i].name, sizeof(products[i].name));
-    products[i].price = parts[1].toFloat();
-    products[i].hasDeposit = parts[2].toInt();
-    products[i].count = parts[3].toInt();
-    products[i].sold = parts[4].toInt();
+    parts[0].toCharArray(catalog.name[i], sizeof(catalog.name[i]));
+    catalog.price[i] = parts[1].toFloat();
+    catalog.hasDeposit[i] = parts[2].toInt();
+    catalog.count[i] = parts[3].toInt();
+    // parts[4] is the number sold, sales are loaded from sales.csv
+    catalog.category[i] = findOrAddCategory(parts[5]);
+    parts[6].trim();
+    catalog.stock[i] = parts[6].length() > 0 ? parts[6].toInt() : STOCK_UNTRACKED;
+    catalog.lowStock[i] = parts[7].length() > 0 ? parts[7].toInt() : config.lowStock;
   }
+  traceSd(SD_OP_PRODUCTS_READ, start, file.size());
   file.close();
   Serial.println(String(color.green) + "[loadProductsFromSD] Products loaded from SD card." + String(color.reset));
 }
 
+// mark data as changed, it is written to SD by flushPendingSaves()
+void scheduleSalesSave() {
+  if (!salesDirty && !productsDirty) firstDirtyMillis = millis();
+  salesDirty = true;
+  sdStats.saveRequests++;
+}
 
-/////////////////////////////////
-// Handler Functions (Backend) //
-/////////////////////////////////
+void scheduleProductsSave() {
+  if (!salesDirty && !productsDirty) firstDirtyMillis = millis();
+  productsDirty = true;
+  sdStats.saveRequests++;
+}
 
-void handleSellProduct(String productName) {
-  for (int i = 0; i < productCount; i++) {
-    if (String(products[i].name) == productName) {
-      products[i].count++; // Increase the sold count
+// write pending changes once the flush window is over (or right away if force is set)
+// when the card fails, it is tried again one flush window later and only the first failure blinks the LED
+void flushPendingSaves(bool force = false) {
+  static bool failing = false;
+  if (!salesDirty && !productsDirty) return;
+  if (!force && millis() - firstDirtyMillis < config.flushWindow) return;
+  bool ok = (!productsDirty || saveProductsToSD()) && (!salesDirty || saveSalesToSD());
+  if (ok) {
+    failing = false;
+    return;
+  }
+  sdStats.failedFlushes++;
+  firstDirtyMillis = millis();
+  if (!failing) error(4); // file error
+  failing = true;
+}
+
+// FNV-1a checksum for snapshot and journal
+uint32_t checksum(const void* data, size_t len, uint32_t hash = 2166136261UL) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+uint32_t journalCheck(const JournalRecord& rec) {
+  return checksum(&rec, offsetof(JournalRecord, check));
+}
+
+// write the full register state to /snapshot.bin and start a new journal
+void writeSnapshot() {
+  unsigned long start = micros();
+  SnapshotHeader header = {};
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.lastSeq = journalSeq;
+  header.productCount = productCount;
+  header.shiftCount = shiftCount;
+  header.nextShiftId = nextShiftId;
+  header.checksum = 2166136261UL;
+  for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+    header.rowSize += snapshotColumnSize[c];
+    header.checksum = checksum(snapshotColumns[c], snapshotColumnSize[c] * productCount, header.checksum);
+  }
+  header.checksum = checksum(shifts, sizeof(Shift) * shiftCount, header.checksum);
+  for (int t = 0; t < SNAPSHOT_TABLES; t++) {
+    header.checksum = checksum(snapshotTables[t], snapshotTableSize[t], header.checksum);
+  }
+  header.checksum = checksum(orderLog.index, sizeof(OrderIndexEntry) * orderLog.indexCount, header.checksum);
+
+  // written to a temporary file first, so a power loss never leaves a half written snapshot behind
+  if (!sdWriter.open("/snapshot.tmp")) {
+    Serial.println("[writeSnapshot] Failed to open file for writing.");
+    sdStats.failedFlushes++;
+    snapshotFailedMillis = millis();
+    if (!snapshotFailing) error(4); // file error
+    snapshotFailing = true;
+    return;
+  }
+  sdWriter.write((const uint8_t*)&header, sizeof(header));
+  for (int c = 0; c < SNAPSHOT_COLUMNS; c++) {
+    sdWriter.write((const uint8_t*)snapshotColumns[c], snapshotColumnSize[c] * productCount);
+  }
+  sdWriter.write((const uint8_t*)shifts, sizeof(Shift) * shiftCount);
+  for (int t = 0; t < SNAPSHOT_TABLES; t++) {
+    sdWriter.write((const uint8_t*)snapshotTables[t], snapshotTableSize[t]);
+  }
+  sdWriter.write((const uint8_t*)orderLog.index, sizeof(OrderIndexEntry) * orderLog.indexCount);
+  sdWriter.close();
+  SD.remove("/snapshot.bin");
+  SD.rename("/snapshot.tmp", "/snapshot.bin");
+
+  // the journal is contained in the snapshot now
+  File journal = SD.open("/journal.bin", FILE_WRITE);
+  if (journal) journal.close();
+  journalSinceSnapshot = 0;
+  snapshotFailing = false;
+  sdStats.snapshotsWritten++;
+  recordFlushTime(start, SD_OP_SNAPSHOT, sdWriter.total);
+  Serial.println(String(color.green) + "[writeSnapshot] Snapshot written in " + String(micros() - start) + " us." + String(color.reset));
+}
+
+// forget what a failed snapshot read already put into the tables, the CSV files are loaded instead
+void clearSnapshotState() {
+  for (int c = 0; c < SNAPSHOT_COLUMNS; c++) memset(snapshotColumns[c], 0, snapshotColumnSize[c] * MAX_PRODUCTS);
+  shiftCount = 0;
+  categoryCount = 0;
+  memset(categories, 0, sizeof(categories));
+  orderLog.nextOrderId = 1; // field by field, a temporary OrderLog would be 8 KB on the stack
+  orderLog.epoch = 0;
+  orderLog.indexedSize = 0;
+  orderLog.lastLoggedId = 0;
+  orderLog.stride = ORDER_INDEX_STRIDE;
+  orderLog.indexCount = 0;
+}
+
+// the data is read into the live tables, they are cleared again if it turns out to be invalid
+bool readSnapshotFile(const char* path) {
+  unsigned long start = micros();
+  File file = SD.open(path);
+  if (!file) return false;
+
+  size_t rowSize = 0;
+  for (int c = 0; c < SNAPSHOT_COLUMNS; c++) rowSize += snapshotColumnSize[c];
+
+  SnapshotHeader header;
+  bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header)
+    && header.magic == SNAPSHOT_MAGIC
+    && header.version == SNAPSHOT_VERSION
+    && header.rowSize == rowSize
+    && header.productCount >= 0 && header.productCount <= MAX_PRODUCTS
+    && header.shiftCount >= 0 && header.shiftCount <= MAX_SHIFTS;
+  uint32_t sum = 2166136261UL;
+  for (int c = 0; c < SNAPSHOT_COLUMNS && ok; c++) {
+    size_t len = snapshotColumnSize[c] * header.productCount;
+    ok = file.read((uint8_t*)snapshotColumns[c], len) == len;
+    sum = checksum(snapshotColumns[c], len, sum);
+  }
+  if (ok) {
+    ok = file.read((uint8_t*)shifts, sizeof(Shift) * header.shiftCount) == sizeof(Shift) * header.shiftCount;
+    sum = checksum(shifts, sizeof(Shift) * header.shiftCount, sum);
+  }
+  for (int t = 0; t < SNAPSHOT_TABLES && ok; t++) {
+    ok = file.read((uint8_t*)snapshotTables[t], snapshotTableSize[t]) == snapshotTableSize[t];
+    sum = checksum(snapshotTables[t], snapshotTableSize[t], sum);
+  }
+  ok = ok && orderLog.indexCount >= 0 && orderLog.indexCount <= ORDER_INDEX_SIZE;
+  if (ok) {
+    size_t len = sizeof(OrderIndexEntry) * orderLog.indexCount;
+    ok = file.read((uint8_t*)orderLog.index, len) == len;
+    sum = checksum(orderLog.index, len, sum);
+  }
+  traceSd(SD_OP_SNAPSHOT_READ, start, file.position());
+  file.close();
+  if (!ok || sum != header.checksum) {
+    clearSnapshotState();
+    return false;
+  }
+
+  productCount = header.productCount;
+  shiftCount = header.shiftCount;
+  nextShiftId = header.nextShiftId;
+  journalSeq = header.lastSeq;
+  return true;
+}
+
+// load the latest snapshot, false if there is no valid one
+bool loadSnapshot() {
+  // snapshot.tmp is only left over if the power was lost while replacing snapshot.bin
+  if (readSnapshotFile("/snapshot.bin") || readSnapshotFile("/snapshot.tmp")) {
+    Serial.println(String(color.green) + "[loadSnapshot] Snapshot loaded, " + String(productCount) + " products." + String(color.reset));
+    return true;
+  }
+  Serial.println(String(color.yellow) + "[loadSnapshot] No valid snapshot found." + String(color.reset));
+  return false;
+}
+
+// add an order to the sparse index, thins out the index when it is full
+void indexOrder(uint32_t id, uint32_t offset) {
+  if (orderLog.indexCount > 0 && id < orderLog.index[orderLog.indexCount - 1].id + orderLog.stride) return;
+  if (orderLog.indexCount == ORDER_INDEX_SIZE) {
+    // keep every second entry, lookups scan twice as many orders from now on
+    for (int i = 0; i < ORDER_INDEX_SIZE / 2; i++) {
+      orderLog.index[i] = orderLog.index[i * 2];
+    }
+    orderLog.indexCount = ORDER_INDEX_SIZE / 2;
+    orderLog.stride *= 2;
+    if (id < orderLog.index[orderLog.indexCount - 1].id + orderLog.stride) return;
+  }
+  orderLog.index[orderLog.indexCount].id = id;
+  orderLog.index[orderLog.indexCount].offset = offset;
+  orderLog.indexCount++;
+}
+
+// index the orders appended to orders.log after the last snapshot
+void indexOrderLogTail() {
+  File file = SD.open("/orders.log");
+  if (!file) return;
+  uint32_t size = file.size();
+  file.seek(orderLog.indexedSize);
+  OrderHeader header;
+  while (orderLog.indexedSize + sizeof(header) <= size && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header)) {
+    uint32_t end = orderLog.indexedSize + sizeof(header) + header.itemCount * sizeof(OrderItem);
+    // stop at a record that was cut off by a power loss, the next order overwrites it
+    if (header.magic != ORDER_MAGIC || end > size) break;
+    indexOrder(header.id, orderLog.indexedSize);
+    if (header.id >= orderLog.nextOrderId) orderLog.nextOrderId = header.id + 1;
+    if (header.id > orderLog.lastLoggedId) orderLog.lastLoggedId = header.id;
+    orderLog.indexedSize = end;
+    file.seek(end);
+  }
+  file.close();
+}
+
+// continue after the orders in orders.log without indexing them (used when there is no snapshot,
+// the existing orders can't be voided then anyway): only the end of the file is read for the last order id
+void skipOrderLog() {
+  unsigned long start = micros();
+  File file = SD.open("/orders.log");
+  if (!file) return;
+  // the last complete order starts within two of the largest records from the end (the last one may be cut off)
+  static uint8_t tail[2 * (sizeof(OrderHeader) + MAX_PRODUCTS * sizeof(OrderItem))];
+  uint32_t size = file.size();
+  uint32_t base = size > sizeof(tail) ? (size - sizeof(tail)) & ~3UL : 0; // orders start at multiples of 4
+  uint32_t len = file.seek(base) ? file.read(tail, size - base) : 0;
+  traceSd(SD_OP_ORDER_READ, start, len);
+  file.close();
+
+  bool found = false;
+  for (uint32_t p = 0; p + sizeof(OrderHeader) <= len; p += 4) {
+    OrderHeader header;
+    memcpy(&header, tail + p, sizeof(header));
+    if (header.magic != ORDER_MAGIC || header.itemCount > MAX_PRODUCTS) continue;
+    if (p + sizeof(header) + header.itemCount * sizeof(OrderItem) > len) continue;
+    if (header.id >= orderLog.nextOrderId) orderLog.nextOrderId = header.id + 1;
+    if (header.id > orderLog.lastLoggedId) orderLog.lastLoggedId = header.id;
+    found = true;
+  }
+  if (!found && size > 0) {
+    indexOrderLogTail(); // no complete order at the end, read the whole file
+    return;
+  }
+  orderLog.indexedSize = size; // new orders go behind everything, the index starts empty
+}
+
+// find an order in orders.log, reads its header and returns its position (-1 if not found)
+long findOrder(uint32_t id, OrderHeader& header) {
+  // last index entry at or before the order
+  int lo = 0;
+  int hi = orderLog.indexCount - 1;
+  int entry = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (orderLog.index[mid].id <= id) {
+      entry = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (entry < 0) return -1;
+
+  // scan from there, at most stride orders
+  unsigned long start = micros();
+  File file = SD.open("/orders.log");
+  if (!file) return -1;
+  uint32_t offset = orderLog.index[entry].offset;
+  uint32_t bytes = 0;
+  long found = -1;
+  while (offset < orderLog.indexedSize && file.seek(offset) && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header)) {
+    bytes += sizeof(header);
+    if (header.magic != ORDER_MAGIC || header.id > id) break;
+    if (header.id == id) {
+      found = offset;
       break;
     }
+    offset += sizeof(header) + header.itemCount * sizeof(OrderItem);
   }
+  file.close();
+  traceSd(SD_OP_ORDER_READ, start, bytes);
+  return found;
+}
 
+// read the items of an order found with findOrder
+bool readOrderItems(long offset, const OrderHeader& header, OrderItem* items) {
+  unsigned long start = micros();
+  File file = SD.open("/orders.log");
+  if (!file) return false;
+  size_t len = header.itemCount * sizeof(OrderItem);
+  bool ok = file.seek(offset + sizeof(OrderHeader)) && file.read((uint8_t*)items, len) == len;
+  file.close();
+  traceSd(SD_OP_ORDER_READ, start, len);
+  return ok;
 }
 
-// cacluate total price of all products in cart
-float calculateTotal() {
-  float total = 0;
-  for (int i = 0; i < productCount; i++) {
-    total += products[i].count * products[i].price;
-    if (products[i].hasDeposit) total += products[i].count * 1.0;
+// overwrite part of an order in orders.log (status, refunded quantities)
+void patchOrderLog(uint32_t position, const void* data, size_t len) {
+  unsigned long start = micros();
+  File file = SD.open("/orders.log", "r+");
+  if (!file) {
+    error(4); // file error
+    return;
   }
-  return total;
+  file.seek(position);
+  file.write((const uint8_t*)data, len);
+  file.close();
+  traceSd(SD_OP_ORDER_PATCH, start, len);
 }
 
-// calculate total deposit of all products in cart (is gonna be shown as already included in total price)
-float calculateDeposit() {
-  float deposit = 0;
+// append an order to orders.log and index it
+// it is written at the end of the indexed orders, so it replaces a record cut off by a power loss
+void appendOrder(const OrderHeader& header, const OrderItem* items) {
+  unsigned long start = micros();
+  uint32_t offset = orderLog.indexedSize;
+  if (!sdWriter.open("/orders.log", SD.exists("/orders.log") ? "r+" : FILE_WRITE) || !sdWriter.seek(offset)) {
+    Serial.println("[appendOrder] Failed to open order log for writing.");
+    if (sdWriter.file) sdWriter.file.close();
+    error(4); // file error
+    return;
+  }
+  sdWriter.write((const uint8_t*)&header, sizeof(header));
+  sdWriter.write((const uint8_t*)items, header.itemCount * sizeof(OrderItem));
+  sdWriter.close();
+  recordFlushTime(start, SD_OP_ORDER_APPEND, sdWriter.total);
+  if (header.id > orderLog.lastLoggedId) orderLog.lastLoggedId = header.id;
+  indexOrder(header.id, offset);
+  orderLog.indexedSize = offset + sizeof(header) + header.itemCount * sizeof(OrderItem);
+}
+
+// apply a journal record to the register state (used for new orders and for replay at boot)
+void applyJournalRecord(const JournalRecord& rec) {
+  Shift* shift = rec.shift ? findShift(rec.shift) : nullptr;
+  switch (rec.type) {
+    case JOURNAL_SALE:
+      if (rec.product >= productCount) break;
+      catalog.totalSold[rec.product] += rec.qty;
+      if (catalog.stock[rec.product] != STOCK_UNTRACKED) {
+        // taken from stock in the same commit as the sale (voids and refunds put it back)
+        StockState before = stockState(rec.product);
+        catalog.stock[rec.product] -= rec.qty;
+        if (stockState(rec.product) != before) stockVersion++;
+      }
+      if (shift) {
+        shift->revenue += rec.amount;
+        shift->deposit += rec.deposit;
+        shift->items += rec.qty;
+        shift->sold[rec.product] += rec.qty;
+      }
+      break;
+    case JOURNAL_ORDER:
+      if (shift) shift->orders++;
+      if (rec.order >= orderLog.nextOrderId) orderLog.nextOrderId = rec.order + 1;
+      break;
+    case JOURNAL_VOID:
+    case JOURNAL_REFUND: {
+      if (rec.type == JOURNAL_VOID && shift) shift->orders--;
+      // mark it in the order log (again, when replayed), so it can't be reversed twice
+      OrderHeader header;
+      long offset = findOrder(rec.order, header);
+      if (offset < 0) break;
+      if (rec.type == JOURNAL_VOID) {
+        uint8_t status = ORDER_VOIDED;
+        patchOrderLog(offset + offsetof(OrderHeader, status), &status, sizeof(status));
+      } else {
+        int16_t refunded = rec.qty;
+        patchOrderLog(offset + sizeof(OrderHeader) + rec.product * sizeof(OrderItem) + offsetof(OrderItem, refunded), &refunded, sizeof(refunded));
+      }
+      break;
+    }
+  }
+}
+
+// replay the journal records written after the snapshot
+void replayJournal() {
+  unsigned long start = micros();
+  File file = SD.open("/journal.bin");
+  if (!file) return;
+
+  int replayed = 0;
+  bool torn = false;
+  JournalRecord rec;
+  static OrderItem items[MAX_PRODUCTS]; // sales of the order being replayed
+  int itemCount = 0;
+  while (file.read((uint8_t*)&rec, sizeof(rec)) == sizeof(rec)) {
+    if (rec.check != journalCheck(rec)) { // torn write at the end of the journal
+      torn = true;
+      break;
+    }
+    if (rec.seq <= journalSeq) continue; // already contained in the snapshot
+    if (rec.type == JOURNAL_SALE) {
+      if (rec.qty > 0 && itemCount < MAX_PRODUCTS) { // negative: reversal of a void or refund
+        OrderItem& item = items[itemCount++];
+        item = {};
+        item.product = rec.product;
+        item.qty = rec.qty;
+        item.price = (rec.amount - rec.deposit) / rec.qty;
+        item.deposit = rec.deposit / rec.qty;
+      }
+    } else if (rec.type == JOURNAL_ORDER) {
+      // the power was lost after the order was booked but before it was written to orders.log
+      if (rec.order > orderLog.lastLoggedId && itemCount > 0) {
+        OrderHeader header = {};
+        header.magic = ORDER_MAGIC;
+        header.itemCount = itemCount;
+        header.id = rec.order;
+        header.shift = rec.shift;
+        header.epoch = orderLog.epoch;
+        header.status = ORDER_BOOKED;
+        appendOrder(header, items);
+        Serial.println(String(color.yellow) + "[replayJournal] Order " + String(rec.order) + " added to orders.log again." + String(color.reset));
+      }
+      itemCount = 0;
+    } else {
+      itemCount = 0;
+    }
+    applyJournalRecord(rec);
+    journalSeq = rec.seq;
+    replayed++;
+  }
+  if (file.position() < file.size()) torn = true; // part of a record
+  traceSd(SD_OP_JOURNAL_READ, start, file.position()); // includes the order log access of the replayed records
+  file.close();
+  journalSinceSnapshot = replayed;
+  Serial.println(String(color.green) + "[replayJournal] " + String(replayed) + " journal records replayed." + String(color.reset));
+  // new records would be appended after the torn one and never be replayed, so start a new journal
+  if (replayed > 0 || torn) writeSnapshot();
+}
+
+// append records to the journal and apply them
+void commitJournal(JournalRecord* recs, int n) {
+  if (n == 0) return;
+  for (int i = 0; i < n; i++) {
+    recs[i].seq = ++journalSeq;
+    recs[i].check = journalCheck(recs[i]);
+  }
+  unsigned long start = micros();
+  if (sdWriter.open("/journal.bin", FILE_APPEND)) {
+    sdWriter.write((const uint8_t*)recs, sizeof(JournalRecord) * n);
+    sdWriter.close();
+    recordFlushTime(start, SD_OP_JOURNAL, sdWriter.total);
+  } else {
+    Serial.println("[commitJournal] Failed to open journal for writing.");
+    error(4); // file error
+  }
+  for (int i = 0; i < n; i++) {
+    applyJournalRecord(recs[i]);
+  }
+  journalSinceSnapshot += n;
+  sdStats.journalRecords += n;
+}
+
+// write the events recorded since the last spill to /trace.bin, which is rotated to /trace.old when full
+// the SD card failed, try again after TRACE_SPILL_INTERVAL instead of on every loop
+void traceSpillFailed() {
+  Serial.println("[spillTrace] Failed to open trace.bin for writing.");
+  recorder.failedSpills++;
+  recorder.spillFailing = true;
+  recorder.lastSpill = millis();
+}
+
+void spillTrace() {
+  uint32_t pending = recorder.head - recorder.spilled;
+  // nothing new except the previous spill itself
+  if (pending == 0) return;
+  if (pending == 1 && recorder.events[recorder.spilled & (TRACE_EVENTS - 1)].type == TRACE_SD
+      && recorder.events[recorder.spilled & (TRACE_EVENTS - 1)].id == SD_OP_TRACE) return;
+  if (pending > TRACE_EVENTS) {
+    recorder.dropped += pending - TRACE_EVENTS;
+    recorder.spilled = recorder.head - TRACE_EVENTS;
+    pending = TRACE_EVENTS;
+  }
+
+  unsigned long start = micros();
+  if (!sdWriter.open("/trace.bin", FILE_APPEND)) {
+    traceSpillFailed();
+    return;
+  }
+  if (sdWriter.file.size() >= TRACE_FILE_SIZE) {
+    sdWriter.close();
+    SD.remove("/trace.old");
+    SD.rename("/trace.bin", "/trace.old");
+    if (!sdWriter.open("/trace.bin", FILE_WRITE)) {
+      traceSpillFailed();
+      return;
+    }
+  }
+  if (sdWriter.file.size() == 0) recorder.routesChanged = true; // every file starts with the route names
+
+  TraceChunk chunk;
+  chunk.magic = TRACE_MAGIC;
+  chunk.version = TRACE_VERSION;
+  chunk.routeCount = recorder.routesChanged ? recorder.routeCount : 0;
+  chunk.eventCount = pending;
+  chunk.dropped = recorder.dropped;
+  sdWriter.write((const uint8_t*)&chunk, sizeof(chunk));
+  sdWriter.write((const uint8_t*)recorder.routes, chunk.routeCount * TRACE_ROUTE_NAME);
+  // the pending events may wrap around the end of the ring
+  uint32_t first = recorder.spilled & (TRACE_EVENTS - 1);
+  uint32_t tail = min(pending, (uint32_t)TRACE_EVENTS - first);
+  sdWriter.write((const uint8_t*)&recorder.events[first], tail * sizeof(TraceEvent));
+  sdWriter.write((const uint8_t*)recorder.events, (pending - tail) * sizeof(TraceEvent));
+  sdWriter.close();
+
+  recorder.spilled += pending;
+  recorder.routesChanged = false;
+  recorder.spillFailing = false;
+  recorder.lastSpill = millis();
+  recordFlushTime(start, SD_OP_TRACE, sdWriter.total);
+}
+
+// config.txt written on first boot, so there is a template to edit
+void writeDefaultConfig() {
+  unsigned long start = micros();
+  File file = SD.open("/config.txt", FILE_WRITE);
+  if (!file) {
+    error(4); // file error
+    return;
+  }
+  Config defaults;
+  file.println("# ShopCalc Pro configuration, one setting per line (key=value)");
+  file.println("# WIFI (password empty or at least 8 characters)");
+  file.println("ssid=" + String(defaults.ssid));
+  file.println("password=" + String(defaults.password));
+  file.println("# max number of products in the shop (1-" + String(MAX_PRODUCTS) + ")");
+  file.println("max_products=" + String(defaults.maxProducts));
+  file.println("# blinking interval of the status led in ms");
+  file.println("blink_interval=" + String(defaults.blinkInterval));
+  file.println("# deposit of products with deposit, single products can differ: deposit.Sekt=2.00");
+  file.println("deposit=" + String(defaults.deposit, 2));
+  file.println("# SPI clock of the SD card in MHz (1-40, lower it if the card is unreliable)");
+  file.println("sd_spi_mhz=" + String(defaults.sdSpiFreq / 1000000));
+  file.println("# ms changes are collected before they are written to SD");
+  file.println("flush_window=" + String(defaults.flushWindow));
+  file.println("# power saving: ms without requests before the CPU is slowed down (0 = off)");
+  file.println("power_idle_after=" + String(defaults.powerIdleAfter));
+  file.println("# ms without requests before the register polls less often, and how often then (ms)");
+  file.println("power_sleep_after=" + String(defaults.powerSleepAfter));
+  file.println("power_sleep_poll=" + String(defaults.powerSleepPoll));
+  file.println("# pricing rules, applied to the cart (optional):");
+  file.println("#   discount.<product or category>=<EUR per unit>[;min=<units>][;time=HH:MM-HH:MM]");
+  file.println("#   e.g. discount.Bier=-0.50;time=17:00-19:00 (happy hour) or discount.Getränke=-0.20;min=6");
+  file.println("#   combo.<name>=<price>:<products>, e.g. combo.Bier+Brezel=5.50:Bier,Brezel (applied in this order)");
+  file.println("# stock at which new products are shown as running low");
+  file.println("low_stock=" + String(defaults.lowStock));
+  file.println("# gzip compression of the product list, config page and CSV export (1 = on, 0 = off)");
+  file.println("gzip=" + String(defaults.gzip ? 1 : 0));
+  file.println("# bytes a response needs to be compressed (benchmarkCompression shows where it pays off)");
+  file.println("gzip_min_size=" + String(defaults.gzipMinSize));
+  traceSd(SD_OP_CONFIG_WRITE, start, file.position());
+  file.close();
+}
+
+// parse one line of config.txt into cfg, problems are added to errors
+void parseConfigLine(String line, Config& cfg, String& errors) {
+  line.trim();
+  if (line.length() == 0 || line.startsWith("#")) return;
+  int eq = line.indexOf('=');
+  if (eq <= 0) {
+    errors += "Ungültige Zeile: " + line + "\n";
+    return;
+  }
+  String key = line.substring(0, eq);
+  String value = line.substring(eq + 1);
+  key.trim();
+  value.trim();
+
+  if (key == "ssid") {
+    if (value.length() == 0 || value.length() >= sizeof(cfg.ssid)) errors += "ssid: 1-32 Zeichen\n";
+    else value.toCharArray(cfg.ssid, sizeof(cfg.ssid));
+  } else if (key == "password") {
+    if ((value.length() > 0 && value.length() < 8) || value.length() >= sizeof(cfg.password)) errors += "password: leer oder 8-63 Zeichen\n";
+    else value.toCharArray(cfg.password, sizeof(cfg.password));
+  } else if (key == "max_products") {
+    long v = value.toInt();
+    if (v < 1 || v > MAX_PRODUCTS) errors += "max_products: 1-" + String(MAX_PRODUCTS) + "\n";
+    else cfg.maxProducts = v;
+  } else if (key == "blink_interval") {
+    long v = value.toInt();
+    if (v < 200 || v > 60000) errors += "blink_interval: 200-60000\n";
+    else cfg.blinkInterval = v;
+  } else if (key == "deposit") {
+    float v = value.toFloat();
+    if (v < 0 || v > 100) errors += "deposit: 0-100\n";
+    else cfg.deposit = v;
+  } else if (key.startsWith("deposit.")) {
+    float v = value.toFloat();
+    if (v < 0 || v > 100) errors += key + ": 0-100\n";
+    else if (cfg.depositOverrideCount >= MAX_DEPOSIT_OVERRIDES) errors += key + ": zu viele Einträge\n";
+    else {
+      DepositOverride& entry = cfg.depositOverrides[cfg.depositOverrideCount++];
+      key.substring(8).toCharArray(entry.name, sizeof(entry.name));
+      entry.amount = v;
+    }
+  } else if (key.startsWith("discount.")) {
+    // discount.<product or category>=<€ per unit>[;min=<units>][;time=HH:MM-HH:MM]
+    if (cfg.discountCount >= MAX_DISCOUNT_RULES) {
+      errors += key + ": zu viele Rabatte\n";
+      return;
+    }
+    DiscountRule rule = {};
+    key.substring(9).toCharArray(rule.target, sizeof(rule.target));
+    rule.minQty = 1;
+    rule.from = -1;
+    rule.to = -1;
+    bool ok = true;
+    int start = 0;
+    for (int part = 0; ok && start <= (int)value.length(); part++) {
+      int semicolon = value.indexOf(';', start);
+      String option = value.substring(start, semicolon < 0 ? value.length() : semicolon);
+      option.trim();
+      start = semicolon < 0 ? value.length() + 1 : semicolon + 1;
+      if (part == 0) {
+        rule.amount = option.toFloat();
+        ok = rule.amount != 0 && rule.amount > -100 && rule.amount < 100;
+      } else if (option.startsWith("min=")) {
+        rule.minQty = option.substring(4).toInt();
+        ok = rule.minQty >= 1 && rule.minQty <= 1000;
+      } else if (option.startsWith("time=")) {
+        int dash = option.indexOf('-');
+        rule.from = dash > 0 ? parseMinute(option.substring(5, dash)) : -1;
+        rule.to = dash > 0 ? parseMinute(option.substring(dash + 1)) : -1;
+        ok = rule.from >= 0 && rule.to >= 0;
+      } else {
+        ok = false;
+      }
+    }
+    if (!ok || strlen(rule.target) == 0) errors += key + ": <€ pro Stück>[;min=<Anzahl>][;time=HH:MM-HH:MM]\n";
+    else cfg.discounts[cfg.discountCount++] = rule;
+  } else if (key.startsWith("combo.")) {
+    // combo.<name>=<price>:<products>
+    int colon = value.indexOf(':');
+    float price = colon > 0 ? value.substring(0, colon).toFloat() : -1;
+    if (cfg.comboCount >= MAX_COMBOS) errors += key + ": zu viele Combos\n";
+    else if (price < 0 || price > 1000 || colon == (int)value.length() - 1) errors += key + ": <Preis>:<Produkt>,<Anzahl>*<Produkt>,...\n";
+    else {
+      ComboRule& rule = cfg.combos[cfg.comboCount++];
+      key.substring(6).toCharArray(rule.name, sizeof(rule.name));
+      rule.price = price;
+      value.substring(colon + 1).toCharArray(rule.items, sizeof(rule.items));
+    }
+  } else if (key == "sd_spi_mhz") {
+    long v = value.toInt();
+    if (v < 1 || v > 40) errors += "sd_spi_mhz: 1-40\n";
+    else cfg.sdSpiFreq = v * 1000000;
+  } else if (key == "flush_window") {
+    long v = value.toInt();
+    if (v < 0 || v > 60000) errors += "flush_window: 0-60000\n";
+    else cfg.flushWindow = v;
+  } else if (key == "power_idle_after") {
+    long v = value.toInt();
+    if (v < 0 || v > 3600000) errors += "power_idle_after: 0-3600000\n";
+    else cfg.powerIdleAfter = v;
+  } else if (key == "power_sleep_after") {
+    long v = value.toInt();
+    if (v < 0 || v > 3600000) errors += "power_sleep_after: 0-3600000\n";
+    else cfg.powerSleepAfter = v;
+  } else if (key == "power_sleep_poll") {
+    long v = value.toInt();
+    if (v < 1 || v > 100) errors += "power_sleep_poll: 1-100\n";
+    else cfg.powerSleepPoll = v;
+  } else if (key == "low_stock") {
+    long v = value.toInt();
+    if (v < 0 || v > 10000) errors += "low_stock: 0-10000\n";
+    else cfg.lowStock = v;
+  } else if (key == "gzip") {
+    if (value != "0" && value != "1") errors += "gzip: 0 oder 1\n";
+    else cfg.gzip = value == "1";
+  } else if (key == "gzip_min_size") {
+    long v = value.toInt();
+    if (v < 0 || v > 65536) errors += "gzip_min_size: 0-65536\n";
+    else cfg.gzipMinSize = v;
+  } else {
+    errors += "Unbekannte Einstellung: " + key + "\n";
+  }
+}
+
+// read config.txt and apply it, invalid settings keep their default
+void loadConfigFromSD() {
+  if (!SD.exists("/config.txt")) {
+    Serial.println(String(color.blue) + "[loadConfigFromSD] No config found, writing default config.txt." + String(color.reset));
+    writeDefaultConfig();
+  }
+
+  static Config loaded; // ~2 KB with the pricing rules, kept off the stack
+  loaded = Config();
+  String errors;
+  unsigned long start = micros();
+  File file = SD.open("/config.txt");
+  if (!file) {
+    errors = "config.txt konnte nicht gelesen werden\n";
+  } else {
+    while (file.available()) {
+      parseConfigLine(file.readStringUntil('\n'), loaded, errors);
+    }
+    traceSd(SD_OP_CONFIG_READ, start, file.size());
+    file.close();
+  }
+  configErrors = errors;
+  if (errors.length() > 0) {
+    Serial.print(String(color.yellow) + "[loadConfigFromSD] Problems in config.txt:\n" + errors + String(color.reset));
+  }
+
+  bool wifiChanged = strcmp(loaded.ssid, config.ssid) != 0 || strcmp(loaded.password, config.password) != 0;
+  bool spiChanged = loaded.sdSpiFreq != config.sdSpiFreq;
+  config = loaded;
+  buildDepositTable();
+  compilePricing(); // the rules may have changed
+
+  // on reload the running services have to pick up the changes
+  if (spiChanged) {
+    flushPendingSaves(true); // with the old settings, the card may not come back with the new ones
+    SD.end();
+    if (!SD.begin(SD_CS, SPI, config.sdSpiFreq)) error(2); // SD card not initialized
+  }
+  if (wifiChanged && (uint32_t)WiFi.softAPIP() != 0) { // AP is already running
+    WiFi.softAP(config.ssid, config.password);
+  }
+  Serial.println(String(color.green) + "[loadConfigFromSD] Config loaded." + String(color.reset));
+}
+
+
+//////////////////////
+// Power management //
+//////////////////////
+
+// In softAP mode the radio has to listen all the time (modem sleep only works as a station),
+// so the power is saved on the CPU: lower clock and sleeping between polls instead of spinning.
+enum PowerState {
+  POWER_ACTIVE, // full clock, the loop spins
+  POWER_IDLE, // low clock, the loop sleeps POWER_IDLE_POLL ms
+  POWER_SLEEP, // low clock, the loop sleeps config.powerSleepPoll ms
+  POWER_STATES
+};
+const char* const powerStateNames[POWER_STATES] = {"active", "idle", "sleep"};
+
+struct PowerGovernor {
+  PowerState state = POWER_ACTIVE;
+  unsigned long lastActivity = 0; // millis of the last request
+  unsigned long stateSince = 0; // millis when the current state was entered
+  unsigned long timeIn[POWER_STATES] = {}; // ms spent in each state (without the current period)
+  unsigned long transitions = 0; // state changes
+  unsigned long wakeups = 0; // wake-ups by a waiting client
+  unsigned long lastWakeMicros = 0; // time from the start of the last sleep until the clock was up again for a waiting client
+  unsigned long maxWakeMicros = 0;
+  unsigned long sleepStart = 0; // micros when the loop last started sleeping
+  unsigned long minuteStart = 0; // start of the current request rate minute
+  unsigned long minuteRequests = 0; // requests in the current minute
+  unsigned long lastMinuteRequests = 0; // requests in the last full minute
+} power;
+
+void setPowerState(PowerState state) {
+  if (state == power.state) return;
+  unsigned long now = millis();
+  power.timeIn[power.state] += now - power.stateSince;
+  power.stateSince = now;
+  power.transitions++;
+  if ((state == POWER_ACTIVE) != (power.state == POWER_ACTIVE)) {
+    setCpuFrequencyMhz(state == POWER_ACTIVE ? POWER_ACTIVE_MHZ : POWER_IDLE_MHZ);
+  }
+  power.state = state;
+  traceEvent(TRACE_POWER, state, now, 0, 0, getCpuFrequencyMhz());
+}
+
+// called for every request served
+void powerActivity() {
+  power.lastActivity = millis();
+  power.minuteRequests++;
+}
+
+// requests per minute, the larger of the current and the last full minute
+unsigned long powerRequestRate() {
+  return max(power.minuteRequests, power.lastMinuteRequests);
+}
+
+// called every loop before the clients are served: back to full clock as soon as a client waits,
+// slower after a while without requests
+void powerGovern() {
+  unsigned long now = millis();
+  if (now - power.minuteStart >= 60000) {
+    power.lastMinuteRequests = power.minuteRequests;
+    power.minuteRequests = 0;
+    power.minuteStart = now;
+  }
+
+  if (power.state != POWER_ACTIVE && (server.hasPendingClient() || configServer.hasPendingClient())) {
+    setPowerState(POWER_ACTIVE);
+    power.wakeups++;
+    power.lastWakeMicros = micros() - power.sleepStart;
+    if (power.lastWakeMicros > power.maxWakeMicros) power.maxWakeMicros = power.lastWakeMicros;
+    return; // stays awake only if the request is counted as activity (not for the stock poll)
+  }
+
+  unsigned long quiet = now - power.lastActivity;
+  if (config.powerIdleAfter == 0 || quiet < config.powerIdleAfter || powerRequestRate() >= POWER_BUSY_RATE) {
+    setPowerState(POWER_ACTIVE);
+  } else if (quiet < config.powerSleepAfter) {
+    setPowerState(POWER_IDLE);
+  } else {
+    setPowerState(POWER_SLEEP);
+  }
+}
+
+// called at the end of the loop, the CPU is halted while the loop sleeps
+void powerSleep() {
+  if (power.state == POWER_ACTIVE) return;
+  power.sleepStart = micros();
+  delay(power.state == POWER_IDLE ? POWER_IDLE_POLL : config.powerSleepPoll);
+}
+
+// share of the uptime spent in a state, in percent
+float powerDutyCycle(PowerState state) {
+  unsigned long now = millis();
+  unsigned long spent = power.timeIn[state] + (state == power.state ? now - power.stateSince : 0);
+  return now > 0 ? spent * 100.0 / now : 0;
+}
+
+
+////////////////////////
+// Request scheduling //
+////////////////////////
+
+enum RequestClass {
+  REQ_CHECKOUT, // cart and checkout, never limited
+  REQ_REPORTING, // sales and analytics
+  REQ_ADMIN, // config and export
+  REQ_CLASSES
+};
+const char* const requestClassNames[REQ_CLASSES] = {"checkout", "reporting", "admin"};
+const unsigned long requestClassBudget[REQ_CLASSES] = {SCHED_WINDOW, 250, 150}; // ms per SCHED_WINDOW while busy
+
+struct RequestClassStats {
+  unsigned long requests = 0; // requests served
+  unsigned long shed = 0; // requests answered with 503 because the budget was used up
+  unsigned long deferred = 0; // loop turns the config server was skipped
+  unsigned long windowMicros = 0; // handler time in the current window
+  unsigned long maxMicros = 0; // slowest request
+  unsigned long histogram[32] = {}; // requests per handler time, bucket b counts times below 2^b us
+};
+
+struct Scheduler {
+  RequestClassStats stats[REQ_CLASSES];
+  unsigned long windowStart = 0; // start of the current budget window
+  unsigned long lastCheckout = 0; // time of the last checkout class request
+  int queueDepth = 0; // servers with a waiting client after the last turn
+  int maxQueueDepth = 0;
+} scheduler;
+
+// true while cashiers are working, the budgets only apply then
+bool shopBusy() {
+  return scheduler.lastCheckout != 0 && millis() - scheduler.lastCheckout < SCHED_BUSY_WINDOW;
+}
+
+bool overBudget(RequestClass cls) {
+  if (millis() - scheduler.windowStart >= SCHED_WINDOW) {
+    scheduler.windowStart = millis();
+    for (int c = 0; c < REQ_CLASSES; c++) scheduler.stats[c].windowMicros = 0;
+  }
+  return shopBusy() && scheduler.stats[cls].windowMicros >= requestClassBudget[cls] * 1000;
+}
+
+void recordRequest(RequestClass cls, unsigned long duration) {
+  RequestClassStats& stats = scheduler.stats[cls];
+  stats.requests++;
+  stats.windowMicros += duration;
+  if (duration > stats.maxMicros) stats.maxMicros = duration;
+  int bucket = 0;
+  while (bucket < 31 && (1UL << bucket) <= duration) bucket++;
+  stats.histogram[bucket]++;
+  if (cls == REQ_CHECKOUT) scheduler.lastCheckout = millis();
+  powerActivity();
+}
+
+// upper bound of the handler time 99% of the requests of a class stayed below
+unsigned long percentile99(RequestClass cls) {
+  const RequestClassStats& stats = scheduler.stats[cls];
+  unsigned long seen = 0;
+  for (int b = 0; b < 32; b++) {
+    seen += stats.histogram[b];
+    if (seen * 100 >= stats.requests * 99) return 1UL << b;
+  }
+  return 0;
+}
+
+// Wrap a handler so its time is counted for its class.
+// Low priority requests on the product page server are answered with 503 while their budget is used up,
+// requests of the config server are deferred in scheduleRequests() instead.
+// Requests are recorded in the flight recorder as well.
+WebServer::THandlerFunction scheduled(RequestClass cls, PriorityWebServer& srv, void (*handler)()) {
+  uint8_t route = traceRoute();
+  return [cls, &srv, handler, route]() {
+    srv.bytesSent = 0;
+    uint32_t startMillis = millis();
+    unsigned long start = micros();
+    if (&srv == &server && cls != REQ_CHECKOUT && overBudget(cls)) {
+      scheduler.stats[cls].shed++;
+      srv.sendHeader("Retry-After", "2");
+      srv.send(503, "text/plain", "Gerade ist viel los an der Kasse, bitte in ein paar Sekunden nochmal versuchen.");
+      traceRequest(route, srv, startMillis, micros() - start);
+      return;
+    }
+    handler();
+    unsigned long duration = micros() - start;
+    recordRequest(cls, duration);
+    traceRequest(route, srv, startMillis, duration);
+  };
+}
+
+// serve waiting clients, checkout traffic first
+void scheduleRequests() {
+  int served = 0;
+  do {
+    server.handleClient(); // product page client handler
+    served++;
+  } while (served < SCHED_MAX_BURST && server.hasPendingClient());
+
+  bool checkoutWaiting = server.hasPendingClient();
+  bool adminWaiting = configServer.hasPendingClient();
+  scheduler.queueDepth = checkoutWaiting + adminWaiting;
+  if (scheduler.queueDepth > scheduler.maxQueueDepth) scheduler.maxQueueDepth = scheduler.queueDepth;
+
+  // config page only when no cashier is waiting and its budget is left
+  if (!checkoutWaiting && !overBudget(REQ_ADMIN)) {
+    configServer.handleClient(); // config page client handler
+  } else if (adminWaiting) {
+    scheduler.stats[REQ_ADMIN].deferred++;
+  }
+}
+
+
+//////////////////////////
+// Response compression //
+//////////////////////////
+
+// Streaming gzip encoder: LZ77 over a small sliding window and the fixed Huffman codes of deflate (RFC 1951/1952).
+// Input is compressed as it is written, only the window and one output chunk are kept, all state is preallocated.
+// Fixed codes need no second pass over a block, the repetitive HTML still shrinks to about a fifth.
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_NIL 0xFFFF
+
+struct Deflater {
+  uint8_t window[2 * DEFLATE_WINDOW]; // history and lookahead, the second half is moved down when full
+  uint16_t head[1 << DEFLATE_HASH_BITS]; // last position of each hash
+  uint16_t prev[DEFLATE_WINDOW]; // previous position with the same hash
+  int pos = 0; // next byte to encode
+  int end = 0; // end of the input in window
+  uint32_t bits = 0; // bits not written to out yet
+  int bitCount = 0;
+  uint8_t out[DEFLATE_OUT];
+  int outLen = 0;
+  uint32_t crc = 0; // CRC-32 of the input, for the gzip trailer
+  uint32_t inSize = 0;
+  uint32_t outSize = 0;
+  uint16_t literalCodes[288]; // fixed Huffman codes, bit-reversed so they can be written LSB first
+  uint8_t literalLengths[288];
+  PriorityWebServer* srv = nullptr; // chunks are sent to it, nullptr: only counted (benchmark)
+} deflater;
+
+// compression statistics, shown on the status page
+struct CompressionStats {
+  uint32_t responses = 0;
+  uint32_t bytesIn = 0;
+  uint32_t bytesOut = 0;
+  uint32_t micros = 0; // time spent compressing
+} compressionStats;
+
+uint32_t reverseBits(uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (int b = 0; b < length; b++) reversed |= ((code >> b) & 1) << (length - 1 - b);
+  return reversed;
+}
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len) {
+  static const uint32_t table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = (crc >> 4) ^ table[(crc ^ data[i]) & 15];
+    crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 15];
+  }
+  return ~crc;
+}
+
+void deflateSendOut() {
+  if (deflater.outLen == 0) return;
+  if (deflater.srv) deflater.srv->sendContent((const char*)deflater.out, deflater.outLen);
+  deflater.outSize += deflater.outLen;
+  deflater.outLen = 0;
+}
+
+void deflateByte(uint8_t b) {
+  deflater.out[deflater.outLen++] = b;
+  if (deflater.outLen == DEFLATE_OUT) deflateSendOut();
+}
+
+// deflate writes values LSB first
+void deflateBits(uint32_t value, int count) {
+  deflater.bits |= value << deflater.bitCount;
+  deflater.bitCount += count;
+  while (deflater.bitCount >= 8) {
+    deflateByte(deflater.bits & 0xFF);
+    deflater.bits >>= 8;
+    deflater.bitCount -= 8;
+  }
+}
+
+void deflateSymbol(int symbol) {
+  deflateBits(deflater.literalCodes[symbol], deflater.literalLengths[symbol]);
+}
+
+void deflateMatch(int length, int distance) {
+  // length code 257-285 with up to 5 extra bits
+  int l = length - DEFLATE_MIN_MATCH;
+  if (length == DEFLATE_MAX_MATCH) {
+    deflateSymbol(285);
+  } else if (l < 8) {
+    deflateSymbol(257 + l);
+  } else {
+    int top = 31 - __builtin_clz(l);
+    deflateSymbol(257 + 4 * (top - 1) + ((l >> (top - 2)) & 3));
+    deflateBits(l & ((1 << (top - 2)) - 1), top - 2);
+  }
+  // distance code 0-29 (5 bits) with up to 13 extra bits
+  int d = distance - 1;
+  if (d < 4) {
+    deflateBits(reverseBits(d, 5), 5);
+  } else {
+    int top = 31 - __builtin_clz(d);
+    deflateBits(reverseBits(2 * top + ((d >> (top - 1)) & 1), 5), 5);
+    deflateBits(d & ((1 << (top - 1)) - 1), top - 1);
+  }
+}
+
+inline int deflateHash(const uint8_t* p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << DEFLATE_HASH_BITS) - 1);
+}
+
+inline void deflateInsert(int p) {
+  int h = deflateHash(deflater.window + p);
+  deflater.prev[p & (DEFLATE_WINDOW - 1)] = deflater.head[h];
+  deflater.head[h] = p;
+}
+
+// encode the window up to limit (leaving room for the longest match unless the stream ends)
+void deflateEncode(int limit) {
+  while (deflater.pos < limit) {
+    int p = deflater.pos;
+    int available = min(DEFLATE_MAX_MATCH, deflater.end - p);
+    int bestLength = 0;
+    int bestDistance = 0;
+    if (available >= DEFLATE_MIN_MATCH) {
+      const uint8_t* current = deflater.window + p;
+      int candidate = deflater.head[deflateHash(current)];
+      for (int chain = DEFLATE_MAX_CHAIN; chain > 0 && candidate != DEFLATE_NIL && candidate < p && p - candidate < DEFLATE_WINDOW; chain--) {
+        const uint8_t* earlier = deflater.window + candidate;
+        if (earlier[bestLength] == current[bestLength]) { // can't be longer otherwise
+          int length = 0;
+          while (length < available && earlier[length] == current[length]) length++;
+          if (length > bestLength) {
+            bestLength = length;
+            bestDistance = p - candidate;
+            if (length == available) break;
+          }
+        }
+        candidate = deflater.prev[candidate & (DEFLATE_WINDOW - 1)];
+      }
+    }
+    if (bestLength >= DEFLATE_MIN_MATCH) {
+      deflateMatch(bestLength, bestDistance);
+      for (int i = 0; i < bestLength; i++) {
+        if (p + i + DEFLATE_MIN_MATCH <= deflater.end) deflateInsert(p + i);
+      }
+      deflater.pos += bestLength;
+    } else {
+      deflateSymbol(deflater.window[p]);
+      if (available >= DEFLATE_MIN_MATCH) deflateInsert(p);
+      deflater.pos++;
+    }
+  }
+}
+
+// move the second half of the window down, positions in the tables move with it
+void deflateSlide() {
+  memmove(deflater.window, deflater.window + DEFLATE_WINDOW, DEFLATE_WINDOW);
+  deflater.pos -= DEFLATE_WINDOW;
+  deflater.end -= DEFLATE_WINDOW;
+  for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) {
+    uint16_t v = deflater.head[i];
+    deflater.head[i] = v != DEFLATE_NIL && v >= DEFLATE_WINDOW ? v - DEFLATE_WINDOW : DEFLATE_NIL;
+  }
+  for (int i = 0; i < DEFLATE_WINDOW; i++) {
+    uint16_t v = deflater.prev[i];
+    deflater.prev[i] = v != DEFLATE_NIL && v >= DEFLATE_WINDOW ? v - DEFLATE_WINDOW : DEFLATE_NIL;
+  }
+}
+
+// start a gzip stream, its chunks are sent to srv
+void deflateBegin(PriorityWebServer* srv) {
+  static bool codesBuilt = false;
+  if (!codesBuilt) {
+    for (int s = 0; s < 288; s++) {
+      int length = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+      int code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xC0 + s - 280;
+      deflater.literalCodes[s] = reverseBits(code, length);
+      deflater.literalLengths[s] = length;
+    }
+    codesBuilt = true;
+  }
+  memset(deflater.head, 0xFF, sizeof(deflater.head));
+  memset(deflater.prev, 0xFF, sizeof(deflater.prev));
+  deflater.srv = srv;
+  deflater.pos = deflater.end = 0;
+  deflater.bits = deflater.bitCount = 0;
+  deflater.outLen = 0;
+  deflater.crc = 0;
+  deflater.inSize = deflater.outSize = 0;
+  static const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF}; // deflate, no name, no time, unknown OS
+  for (uint8_t b : header) deflateByte(b);
+  deflateBits(0, 1); // not the last block
+  deflateBits(1, 2); // fixed Huffman codes
+}
+
+void deflateWrite(const uint8_t* data, size_t len) {
+  deflater.crc = crc32Update(deflater.crc, data, len);
+  deflater.inSize += len;
+  while (len > 0) {
+    if (deflater.end == 2 * DEFLATE_WINDOW) deflateSlide();
+    size_t n = min(len, (size_t)(2 * DEFLATE_WINDOW - deflater.end));
+    memcpy(deflater.window + deflater.end, data, n);
+    deflater.end += n;
+    data += n;
+    len -= n;
+    deflateEncode(deflater.end - DEFLATE_MAX_MATCH);
+  }
+}
+
+void deflateEnd() {
+  deflateEncode(deflater.end);
+  deflateSymbol(256); // end of block
+  deflateBits(1, 1); // last block: empty, fixed codes
+  deflateBits(1, 2);
+  deflateSymbol(256);
+  if (deflater.bitCount > 0) deflateBits(0, 8 - deflater.bitCount);
+  for (int i = 0; i < 4; i++) deflateByte(deflater.crc >> (8 * i));
+  for (int i = 0; i < 4; i++) deflateByte(deflater.inSize >> (8 * i));
+  deflateSendOut();
+}
+
+String* responseCapture = nullptr; // diagnostics: response bodies are collected here instead of sent
+
+// Response body sent in chunks while it is generated, gzip compressed if the client accepts it.
+// The first config.gzipMinSize bytes are held back: a response that ends before is sent as it is, in one piece.
+// Usage: begin(), write() the parts (the String is cleared so it can be reused), end().
+class ResponseStream {
+ public:
+  ResponseStream(PriorityWebServer& srv) : srv(srv) {}
+
+  void begin(int code, const char* type) {
+    this->code = code;
+    this->type = type;
+    started = false;
+    compress = false;
+    held = "";
+  }
+
+  void sendHeader(const String& name, const String& value) {
+    if (!responseCapture) srv.sendHeader(name, value);
+  }
+
+  void write(String& part) {
+    if (responseCapture) {
+      *responseCapture += part;
+    } else if (!started) {
+      held += part;
+      if (held.length() >= config.gzipMinSize) start();
+    } else {
+      sendPart(part);
+    }
+    part = "";
+  }
+
+  void end() {
+    if (responseCapture) return;
+    if (!started) {
+      srv.send(code, type, held); // small enough, not worth compressing
+      held = "";
+      return;
+    }
+    if (compress) {
+      unsigned long start = micros();
+      deflateEnd();
+      compressionStats.micros += micros() - start;
+      compressionStats.responses++;
+      compressionStats.bytesIn += deflater.inSize;
+      compressionStats.bytesOut += deflater.outSize;
+    }
+    srv.sendContent(""); // last chunk
+  }
+
+ private:
+  PriorityWebServer& srv;
+  int code = 200;
+  const char* type = nullptr;
+  bool started = false; // headers are sent, the rest goes out in chunks
+  bool compress = false;
+  String held; // body until it is known to be big enough to compress
+
+  void start() {
+    compress = config.gzip && srv.header("Accept-Encoding").indexOf("gzip") >= 0;
+    srv.setContentLength(CONTENT_LENGTH_UNKNOWN); // chunked
+    if (compress) srv.sendHeader("Content-Encoding", "gzip");
+    srv.send(code, type, "");
+    if (compress) deflateBegin(&srv);
+    started = true;
+    sendPart(held);
+  }
+
+  void sendPart(String& part) {
+    if (compress) {
+      unsigned long start = micros();
+      deflateWrite((const uint8_t*)part.c_str(), part.length());
+      compressionStats.micros += micros() - start;
+    } else if (part.length() > 0) {
+      srv.sendContent(part);
+    }
+    part = "";
+  }
+};
+
+
+/////////////////////////////////
+// Handler Functions (Backend) //
+/////////////////////////////////
+
+void handleSellProduct(String productName) {
   for (int i = 0; i < productCount; i++) {
-    if (products[i].hasDeposit) deposit += products[i].count * 1.0;
+    if (String(catalog.name[i]) == productName) {
+      catalog.count[i]++; // Increase the sold count
+      cartChanged(i, 1);
+      break;
+    }
   }
-  return deposit;
+
+}
+
+// total price of all products in cart and the deposit included in it (is gonna be shown as already included in total price)
+struct CartTotals {
+  float total;
+  float deposit;
+  float discount; // saved by pricing rules
+};
+
+// the totals are kept up to date by cartChanged, only a new time of day can change them here
+CartTotals calculateTotals() {
+  if (pricing.timed && minuteOfDay() != pricing.minute) repriceCart(); // e.g. happy hour started
+  return {(pricing.net + pricing.depositTotal) / 100.0f, pricing.depositTotal / 100.0f, (pricing.listNet - pricing.net) / 100.0f};
 }
 
 
 void handleSalesOverview() {
-  loadSalesFromSD(); // load sales from SD
-  
   // Start the HTML content
   String html = "<h1>Verkäufe</h1>";
   
@@ -308,7 +2609,7 @@ void handleSalesOverview() {
   
   // Loop through the products and add them to the table
   for (int i = 0; i < productCount; i++) {
-    html += "<tr><td>" + String(products[i].name) + "</td><td>" + String(totalSold[i]) + "</td></tr>";
+    html += "<tr><td>" + String(catalog.name[i]) + "</td><td>" + String(catalog.totalSold[i]) + "</td></tr>";
   }
   Serial.print("productCount: ");
   Serial.println(productCount);
@@ -316,14 +2617,17 @@ void handleSalesOverview() {
     Serial.print("Product ");
     Serial.print(i);
     Serial.print(": ");
-    Serial.print(products[i].name);
+    Serial.print(catalog.name[i]);
     Serial.print(" - verkauft: ");
-    Serial.println(totalSold[i]);
+    Serial.println(catalog.totalSold[i]);
   }
   
   // Close the table tag
   html += "</table>";
 
+  // Link to the shift report and the order lookup
+  html += "<p><a href='/shifts'>Schichten und Kassierer</a> | <a href='/order?id=" + String(orderLog.nextOrderId - 1) + "'>Bestellungen (stornieren/erstatten)</a></p>";
+
   // Add the export CSV button
   html += "<form action='/exportSales' method='post'><button type='submit'>Exportiere Verkäufe als CSV</button></form>";
 
@@ -340,82 +2644,429 @@ void handleSalesOverview() {
 
 // Endpoint to handle CSV export
 void handleExportSales() {
+  ResponseStream out(server);
+  out.sendHeader("Content-Disposition", "attachment; filename=sales.csv");
+  out.begin(200, "text/csv");
   String csvData = "Produkt,Anzahl\n";
   for (int i = 0; i < productCount; i++) {
-    csvData += String(products[i].name) + "," + String(totalSold[i]) + "\n";
+    csvData += String(catalog.name[i]) + "," + String(catalog.totalSold[i]) + "\n";
+    if (csvData.length() >= DEFLATE_OUT) out.write(csvData);
   }
-  
-  server.sendHeader("Content-Disposition", "attachment; filename=sales.csv");
-  server.sendHeader("Content-Type", "text/csv");
-  server.send(200, "text/csv", csvData);
+  out.write(csvData);
+  out.end();
+}
+
+// download the flight recorder (trace.old and trace.bin), decoded with serial_reader/trace_decoder.py
+void handleTrace() {
+  spillTrace(); // include the latest events
+  File old = SD.open("/trace.old");
+  File current = SD.open("/trace.bin");
+  size_t size = (old ? old.size() : 0) + (current ? current.size() : 0);
+  configServer.sendHeader("Content-Disposition", "attachment; filename=trace.bin");
+  configServer.setContentLength(size);
+  configServer.send(200, "application/octet-stream", "");
+  static uint8_t buffer[SD_BLOCK_SIZE];
+  File* files[] = {&old, &current};
+  unsigned long startMillis = millis();
+  unsigned long readMicros = 0; // only the SD reads, not the sending in between
+  for (File* file : files) {
+    if (!*file) continue;
+    size_t n;
+    unsigned long start = micros();
+    while ((n = file->read(buffer, sizeof(buffer))) > 0) {
+      readMicros += micros() - start;
+      configServer.sendContent((const char*)buffer, n);
+      start = micros();
+    }
+    file->close();
+  }
+  traceEvent(TRACE_SD, SD_OP_TRACE_READ, startMillis, readMicros, size, 0);
 }
 
 // Endpoint to handle sales reset
 void handleResetSales() {
   // Reset the sales data
   for (int i = 0; i < productCount; i++) {
-    totalSold[i] = 0;
+    catalog.totalSold[i] = 0;
   }
-  saveSalesToSD(); // Save the reset sales data to SD
-  Serial.println("[handleResetSales] Sales data reset and saved to SD card.");
+  orderLog.epoch++; // orders from before the reset can't be voided anymore
+  writeSnapshot();
+  scheduleSalesSave(); // Save the reset sales data to SD
+  Serial.println("[handleResetSales] Sales data reset.");
   
   // Redirect to the sales overview page after resetting
   server.sendHeader("Location", "/sales"); // Redirect to the sales page
   server.send(303); // Send a redirect response
 }
 
+// status page with SD write statistics
+void handleStatus() {
+  String text = "SD card\n";
+  text += "save requests: " + String(sdStats.saveRequests) + "\n";
+  text += "files written: " + String(sdStats.flushCount) + "\n";
+  text += "blocks written: " + String(sdStats.blocksWritten) + "\n";
+  text += "bytes written: " + String(sdStats.bytesWritten) + "\n";
+  text += "last write: " + String(sdStats.lastFlushMicros) + " us\n";
+  text += "max write: " + String(sdStats.maxFlushMicros) + " us\n";
+  text += "pending: " + String((salesDirty || productsDirty) ? "yes" : "no") + ", failed writes: " + String(sdStats.failedFlushes) + "\n";
+  text += "snapshots written: " + String(sdStats.snapshotsWritten) + "\n";
+  text += "journal records: " + String(sdStats.journalRecords) + " (" + String(journalSinceSnapshot) + " since snapshot)\n";
+  text += "boot time: " + String(sdStats.bootMillis) + " ms\n";
+
+  text += "\nRequests (" + String(shopBusy() ? "busy" : "idle") + ", queue depth " + String(scheduler.queueDepth) + ", max " + String(scheduler.maxQueueDepth) + ")\n";
+  for (int c = 0; c < REQ_CLASSES; c++) {
+    const RequestClassStats& stats = scheduler.stats[c];
+    text += String(requestClassNames[c]) + ": " + String(stats.requests) + " served, " + String(stats.shed) + " shed, " + String(stats.deferred) + " deferred";
+    text += ", p99 < " + String(percentile99((RequestClass)c)) + " us, max " + String(stats.maxMicros) + " us\n";
+  }
+
+  text += "\nPower (" + String(powerStateNames[power.state]) + ", " + String(getCpuFrequencyMhz()) + " MHz, " + String(powerRequestRate()) + " requests/min)\n";
+  for (int s = 0; s < POWER_STATES; s++) {
+    text += String(powerStateNames[s]) + ": " + String(powerDutyCycle((PowerState)s), 1) + " %\n";
+  }
+  text += "state changes: " + String(power.transitions) + ", wake-ups: " + String(power.wakeups) + "\n";
+  text += "wake latency: last " + String(power.lastWakeMicros) + " us, max " + String(power.maxWakeMicros) + " us\n";
+
+  text += "\nFlight recorder\n";
+  text += "events: " + String(recorder.head) + " (" + String(recorder.head - recorder.spilled) + " not on SD yet, " + String(recorder.dropped) + " lost, " + String(recorder.failedSpills) + " failed writes)\n";
+  text += "download: http://" + WiFi.softAPIP().toString() + ":8080/trace\n";
+
+  text += "\nCompression (" + String(config.gzip ? "on from " + String(config.gzipMinSize) + " bytes" : "off") + ")\n";
+  text += "responses: " + String(compressionStats.responses) + ", " + String(compressionStats.bytesIn) + " -> " + String(compressionStats.bytesOut) + " bytes";
+  if (compressionStats.bytesIn > 0) text += ", " + String(compressionStats.micros / (compressionStats.bytesIn / 1024.0f), 0) + " us/KB";
+  text += "\n";
+  server.send(200, "text/plain", text);
+}
+
 // add, remove, clear product functions
 void handleAdd() {
+  selectCart(server.client().remoteIP());
   int id = server.arg("id").toInt();
   int q = server.arg("quantity").toInt();
-  if (id >= 0 && id < productCount) products[id].count += q;
+  if (id >= 0 && id < productCount) {
+    int available = stockAvailable(id); // no more than in stock
+    int delta = q > available ? max(0, available) : max(0, q); // removing goes through /remove
+    catalog.count[id] += delta;
+    cartChanged(id, delta);
+  }
+  server.send(200, "text/plain", "OK");
+}
+
+// log in a cashier on this terminal and open a shift
+void handleOpenShift() {
+  uint32_t terminal = server.client().remoteIP();
+  String cashier = server.arg("cashier");
+  cashier.trim();
+  if (cashier.length() == 0) {
+    server.send(400, "text/plain", "Name fehlt");
+    return;
+  }
+  if (findOpenShift(terminal)) {
+    server.send(409, "text/plain", "Auf diesem Gerät ist schon eine Schicht offen");
+    return;
+  }
+
+  // make room by dropping the oldest closed shift
+  if (shiftCount == MAX_SHIFTS) {
+    int oldest = -1;
+    for (int i = 0; i < shiftCount && oldest < 0; i++) {
+      if (!shifts[i].open) oldest = i;
+    }
+    if (oldest < 0) {
+      server.send(409, "text/plain", "Zu viele offene Schichten");
+      return;
+    }
+    for (int i = oldest; i < shiftCount - 1; i++) {
+      shifts[i] = shifts[i + 1];
+    }
+    shiftCount--;
+  }
+
+  Shift& shift = shifts[shiftCount++];
+  shift = {};
+  shift.id = nextShiftId++;
+  cashier.toCharArray(shift.cashier, sizeof(shift.cashier));
+  shift.terminal = terminal;
+  shift.open = true;
+  shift.openingCash = server.arg("cash").toFloat();
+  writeSnapshot(); // journal records after this refer to the new shift
+  Serial.println("[handleOpenShift] Shift " + String(shift.id) + " opened by " + String(shift.cashier));
   server.send(200, "text/plain", "OK");
 }
 
+// close the shift of this terminal with the counted cash
+void handleCloseShift() {
+  Shift* shift = findOpenShift(server.client().remoteIP());
+  if (!shift) {
+    server.send(404, "text/plain", "Keine offene Schicht auf diesem Gerät");
+    return;
+  }
+  shift->open = false;
+  shift->countedCash = server.arg("cash").toFloat();
+  writeSnapshot();
+  float difference = shift->countedCash - (shift->openingCash + shift->revenue);
+  Serial.println("[handleCloseShift] Shift " + String(shift->id) + " closed, difference " + String(difference, 2));
+  server.send(200, "text/plain", "Differenz: " + String(difference, 2) + " €");
+}
+
+// shift report, all numbers are kept up to date with every order
+void handleShifts() {
+  String html = "<h1>Schichten</h1>";
+  html += "<table border='1'><tr><th>Nr.</th><th>Kassierer</th><th>Status</th><th>Bestellungen</th><th>Artikel</th><th>Umsatz</th><th>Pfand</th><th>Anfangsbestand</th><th>Gezählt</th><th>Differenz</th></tr>";
+  for (int i = shiftCount - 1; i >= 0; i--) {
+    const Shift& shift = shifts[i];
+    float expected = shift.openingCash + shift.revenue;
+    html += "<tr><td>" + String(shift.id) + "</td><td>" + String(shift.cashier) + "</td>";
+    html += "<td>" + String(shift.open ? "offen" : "geschlossen") + "</td>";
+    html += "<td>" + String(shift.orders) + "</td><td>" + String(shift.items) + "</td>";
+    html += "<td>" + String(shift.revenue, 2) + " €</td><td>" + String(shift.deposit, 2) + " €</td>";
+    html += "<td>" + String(shift.openingCash, 2) + " €</td>";
+    if (shift.open) {
+      html += "<td>-</td><td>-</td></tr>";
+    } else {
+      html += "<td>" + String(shift.countedCash, 2) + " €</td><td>" + String(shift.countedCash - expected, 2) + " €</td></tr>";
+    }
+  }
+  html += "</table>";
+
+  // items per product and shift
+  html += "<h2>Verkäufe pro Schicht</h2><table border='1'><tr><th>Produkt</th>";
+  for (int i = shiftCount - 1; i >= 0; i--) {
+    html += "<th>" + String(shifts[i].id) + " " + String(shifts[i].cashier) + "</th>";
+  }
+  html += "</tr>";
+  for (int p = 0; p < productCount; p++) {
+    html += "<tr><td>" + String(catalog.name[p]) + "</td>";
+    for (int i = shiftCount - 1; i >= 0; i--) {
+      html += "<td>" + String(shifts[i].sold[p]) + "</td>";
+    }
+    html += "</tr>";
+  }
+  html += "</table>";
+
+  server.sendHeader("Content-Type", "text/html; charset=UTF-8");
+  server.send(200, "text/html", html);
+}
+
 // remove product from cart
 void handleRemove() {
+  selectCart(server.client().remoteIP());
   int id = server.arg("id").toInt();
-  if (id >= 0 && id < productCount && products[id].count > 0) products[id].count--;
+  if (id >= 0 && id < productCount && catalog.count[id] > 0) {
+    catalog.count[id]--;
+    cartChanged(id, -1);
+  }
   server.send(200, "text/plain", "OK");
 }
 
 // clear all products in cart
 void handleClear() {
-  for (int i = 0; i < productCount; i++) products[i].count = 0;
+  selectCart(server.client().remoteIP());
+  for (int i = 0; i < productCount; i++) catalog.count[i] = 0;
+  repriceCart();
   server.send(200, "text/plain", "OK");
 }
 
 // submit order to server and save to SD
 void handleSubmit() {
+  // the cart of this terminal is booked on the shift of the cashier logged in on it
+  uint32_t terminal = server.client().remoteIP();
+  selectCart(terminal);
+  Shift* shift = findOpenShift(terminal);
+  static JournalRecord recs[MAX_PRODUCTS + 1];
+  static OrderItem items[MAX_PRODUCTS];
+  static int32_t paid[MAX_PRODUCTS]; // cents after discounts and combos
+  OrderHeader header = {};
+  header.magic = ORDER_MAGIC;
+  header.id = orderLog.nextOrderId;
+  header.shift = shift ? shift->id : 0;
+  header.epoch = orderLog.epoch;
+  header.status = ORDER_BOOKED;
+
+  // the whole order is refused if a product is no longer in stock (e.g. sold out after it was put in the cart)
+  String missing;
+  for (int i = 0; i < productCount; i++) {
+    if (catalog.count[i] > 0 && stockAvailable(i) < 0) {
+      missing += String(catalog.name[i]) + " (noch " + String(catalog.stock[i]) + ")\n";
+    }
+  }
+  if (missing.length() > 0) {
+    server.send(409, "text/plain", "Nicht genug auf Lager:\n" + missing);
+    return;
+  }
+
+  calculateTotals(); // prices of the current time of day
+  cartLineAmounts(paid);
+  int n = 0;
   for (int i = 0; i < productCount; i++) {
-    totalSold[i] += products[i].count;
-    products[i].count = 0;
+    if (catalog.count[i] != 0) {
+      recs[n] = {};
+      recs[n].type = JOURNAL_SALE;
+      recs[n].product = i;
+      recs[n].qty = catalog.count[i];
+      recs[n].shift = header.shift;
+      recs[n].order = header.id;
+      recs[n].deposit = catalog.count[i] * catalog.deposit[i];
+      recs[n].amount = paid[i] / 100.0f + recs[n].deposit;
+      items[n] = {};
+      items[n].product = i;
+      items[n].qty = catalog.count[i];
+      items[n].price = paid[i] / 100.0f / catalog.count[i]; // refunds pay back what was paid
+      items[n].deposit = catalog.deposit[i];
+      n++;
+    }
+    catalog.count[i] = 0;
+  }
+  repriceCart();
+  if (n == 0) {
+    server.send(200, "text/plain", "0"); // empty cart, no order
+    return;
+  }
+  header.itemCount = n;
+  recs[n] = {};
+  recs[n].type = JOURNAL_ORDER;
+  recs[n].shift = header.shift;
+  recs[n].order = header.id;
+
+  commitJournal(recs, n + 1); // order is safe on SD as soon as it is in the journal
+  appendOrder(header, items); // for looking it up and voiding it later
+  scheduleSalesSave(); // written to SD together with other orders of the flush window
+  server.send(200, "text/plain", String(header.id)); // order id, shown on the product page
+}
+
+// Reverse items of an order: qty[i] items of item i are booked back, on the shift of the order if it is still open,
+// otherwise on the shift of this terminal (that's where the cash is paid out).
+// Returns an error text or an empty string.
+String reverseOrder(uint32_t id, int onlyItem, int quantity) {
+  static OrderItem items[MAX_PRODUCTS];
+  static JournalRecord recs[MAX_PRODUCTS + 1];
+  OrderHeader header;
+  long offset = findOrder(id, header);
+  if (offset < 0) return "Bestellung nicht gefunden";
+  if (header.status == ORDER_VOIDED) return "Bestellung ist schon storniert";
+  if (header.epoch != orderLog.epoch) return "Bestellung ist älter als die letzte Änderung der Produkte oder Verkäufe";
+  if (header.itemCount > MAX_PRODUCTS || !readOrderItems(offset, header, items)) return "Bestellung konnte nicht gelesen werden";
+  if (onlyItem >= header.itemCount) return "Artikel nicht in der Bestellung";
+
+  Shift* shift = findShift(header.shift);
+  if (!shift || !shift->open) shift = findOpenShift(server.client().remoteIP());
+
+  int n = 0;
+  for (int i = 0; i < header.itemCount; i++) {
+    if (onlyItem >= 0 && i != onlyItem) continue;
+    int open = items[i].qty - items[i].refunded;
+    int qty = onlyItem >= 0 ? quantity : open;
+    if (qty <= 0 || qty > open) {
+      if (onlyItem >= 0) return "Ungültige Anzahl";
+      continue;
+    }
+    recs[n] = {};
+    recs[n].type = JOURNAL_SALE;
+    recs[n].product = items[i].product;
+    recs[n].qty = -qty;
+    recs[n].shift = shift ? shift->id : 0;
+    recs[n].order = id;
+    recs[n].deposit = -qty * items[i].deposit;
+    recs[n].amount = -qty * items[i].price + recs[n].deposit;
+    n++;
+    if (onlyItem >= 0) {
+      recs[n] = {};
+      recs[n].type = JOURNAL_REFUND;
+      recs[n].product = i;
+      recs[n].qty = items[i].refunded + qty;
+      recs[n].order = id;
+      n++;
+    }
+  }
+  if (onlyItem < 0) {
+    recs[n] = {};
+    recs[n].type = JOURNAL_VOID;
+    recs[n].shift = header.shift == (shift ? shift->id : 0) ? header.shift : 0;
+    recs[n].order = id;
+    n++;
+  }
+  commitJournal(recs, n);
+  scheduleSalesSave();
+  Serial.println("[reverseOrder] Order " + String(id) + (onlyItem < 0 ? " voided." : " partly refunded."));
+  return "";
+}
+
+// void a whole order ("oops, wrong button")
+void handleVoid() {
+  String result = reverseOrder(server.arg("order").toInt(), -1, 0);
+  if (result.length() > 0) {
+    server.send(409, "text/plain", result);
+    return;
   }
-  saveSalesToSD();
   server.send(200, "text/plain", "OK");
+}
 
-  // Verkäufe aktualisieren (already handled above)
+// refund some items of an order
+void handleRefund() {
+  int item = server.arg("item").toInt();
+  if (item < 0) { // reverseOrder would void the whole order
+    server.send(400, "text/plain", "Ungültiger Artikel");
+    return;
+  }
+  String result = reverseOrder(server.arg("order").toInt(), item, server.arg("quantity").toInt());
+  if (result.length() > 0) {
+    server.send(409, "text/plain", result);
+    return;
+  }
+  server.sendHeader("Location", "/order?id=" + server.arg("order"));
+  server.send(303);
+}
 
-  saveSalesToSD(); // Deine Funktion zum Speichern der Verkäufe
+// show one order with buttons to void it or refund single items
+void handleOrder() {
+  uint32_t id = server.arg("id").toInt();
+  String html = "<meta charset='UTF-8'><h1>Bestellung</h1>";
+  html += "<form action='/order'><input type='number' name='id' value='" + String(id) + "'><button type='submit'>Suchen</button></form>";
+
+  static OrderItem items[MAX_PRODUCTS];
+  OrderHeader header;
+  long offset = id > 0 ? findOrder(id, header) : -1;
+  if (offset < 0 || header.itemCount > MAX_PRODUCTS || !readOrderItems(offset, header, items)) {
+    if (id > 0) html += "<p>Bestellung " + String(id) + " nicht gefunden.</p>";
+  } else {
+    Shift* shift = findShift(header.shift);
+    html += "<p>Bestellung " + String(header.id) + (shift ? " von " + String(shift->cashier) : String("")) + (header.status == ORDER_VOIDED ? " <strong>(storniert)</strong>" : "") + "</p>";
+    html += "<table border='1'><tr><th>Produkt</th><th>Anzahl</th><th>Preis</th><th>Pfand</th><th>Erstattet</th><th></th></tr>";
+    for (int i = 0; i < header.itemCount; i++) {
+      const OrderItem& item = items[i];
+      String name = item.product < productCount && header.epoch == orderLog.epoch ? String(catalog.name[item.product]) : "#" + String(item.product);
+      html += "<tr><td>" + name + "</td><td>" + String(item.qty) + "</td><td>" + String(item.price, 2) + " €</td><td>" + String(item.deposit, 2) + " €</td><td>" + String(item.refunded) + "</td><td>";
+      if (header.status != ORDER_VOIDED && item.refunded < item.qty) {
+        html += "<form action='/refund' method='post'><input type='hidden' name='order' value='" + String(header.id) + "'><input type='hidden' name='item' value='" + String(i) + "'>";
+        html += "<input type='number' name='quantity' value='1' min='1' max='" + String(item.qty - item.refunded) + "'><button type='submit'>Erstatten</button></form>";
+      }
+      html += "</td></tr>";
+    }
+    html += "</table>";
+    if (header.status != ORDER_VOIDED) {
+      html += "<button onclick=\"fetch('/void?order=" + String(header.id) + "').then(r => r.text()).then(t => { alert(t); location.reload(); })\">Ganze Bestellung stornieren</button>";
+    }
+  }
+  html += "<p><a href='/sales'>Zurück zu den Verkäufen</a></p>";
+  server.send(200, "text/html", html);
 }
 
 void handleResetProducts() {
   // delete all products without overwriting with default products
-  for (int i = 0; i < productCount; i++) {
-    products[i] = {};
-    totalSold[i] = 0;
-  }
+  while (productCount > 0) catalogRemove(productCount - 1);
 
   // Reset to default products
   productCount = defaultProductCount;
   for (int i = 0; i < productCount; i++) {
-    products[i] = defaultProducts[i];
-    totalSold[i] = 0;
+    catalogSet(i, defaultProducts[i]);
   }
 
+  catalogChanged();
+
   // Save to SD
-  saveProductsToSD();
-  saveSalesToSD();
+  writeSnapshot();
+  scheduleProductsSave();
+  scheduleSalesSave();
 
   Serial.println("[handleResetProducts] Products reset to defaults.");
 
@@ -430,23 +3081,15 @@ void handleDeleteProduct() {
 
   // Ensure the ID is within valid range
   if (id >= 0 && id < productCount) {
-    // Shift products and sales data
-    for (int i = id; i < productCount - 1; i++) {
-      products[i] = products[i + 1];
-      totalSold[i] = totalSold[i + 1]; // shift sales too
-    }
-
-    // Clear the last product for cleanup (optional)
-    Product emptyProduct = {};
-    products[productCount - 1] = emptyProduct;
-    totalSold[productCount - 1] = 0;
-
-    // Decrease the product count
-    productCount--;
+    // Remove the product with its sales data
+    catalogRemove(id);
+    catalogChanged();
 
     // Save the updated products and sales to SD
-    saveProductsToSD();
-    saveSalesToSD();
+    // snapshot right away, journal records after this refer to the new product indices
+    writeSnapshot();
+    scheduleProductsSave();
+    scheduleSalesSave();
   }
 
   // Send success response to the client
@@ -458,79 +3101,75 @@ void handleSaveConfig() {
   for (int i = 0; i < productCount; i++) {
     if (configServer.hasArg("name_" + String(i))) {
       String name = configServer.arg("name_" + String(i));
-      name.toCharArray(products[i].name, sizeof(products[i].name));
-      products[i].price = configServer.arg("price_" + String(i)).toFloat();
-      products[i].hasDeposit = configServer.hasArg("deposit_" + String(i));
+      name.toCharArray(catalog.name[i], sizeof(catalog.name[i]));
+      catalog.price[i] = configServer.arg("price_" + String(i)).toFloat();
+      catalog.hasDeposit[i] = configServer.hasArg("deposit_" + String(i));
+      catalog.category[i] = findOrAddCategory(configServer.arg("category_" + String(i)));
+      // stock is only set if it was edited, so sales since the page was loaded are not lost
+      String stock = configServer.arg("stock_" + String(i));
+      stock.trim();
+      if (stock != configServer.arg("stock_shown_" + String(i))) {
+        catalog.stock[i] = stock.length() > 0 ? max(0L, stock.toInt()) : STOCK_UNTRACKED;
+      }
+      int restock = configServer.arg("restock_" + String(i)).toInt();
+      if (restock != 0) {
+        catalog.stock[i] = max(0, (catalog.stock[i] == STOCK_UNTRACKED ? 0 : catalog.stock[i]) + restock);
+      }
+      catalog.lowStock[i] = max(0L, configServer.arg("low_" + String(i)).toInt());
     }
   }
-  if (configServer.hasArg("new_name") && configServer.arg("new_name").length() > 0 && productCount < MAX_PRODUCTS) {
+  if (configServer.hasArg("new_name") && configServer.arg("new_name").length() > 0 && productCount < config.maxProducts) {
     String name = configServer.arg("new_name");
-    name.toCharArray(products[productCount].name, sizeof(products[productCount].name));
-    products[productCount].price = configServer.arg("new_price").toFloat();
-    products[productCount].hasDeposit = configServer.hasArg("new_deposit");
-    products[productCount].count = 0;
+    name.toCharArray(catalog.name[productCount], sizeof(catalog.name[productCount]));
+    catalog.price[productCount] = configServer.arg("new_price").toFloat();
+    catalog.hasDeposit[productCount] = configServer.hasArg("new_deposit");
+    catalog.count[productCount] = 0;
+    catalog.category[productCount] = findOrAddCategory(configServer.arg("new_category"));
+    String stock = configServer.arg("new_stock");
+    stock.trim();
+    catalog.stock[productCount] = stock.length() > 0 ? max(0L, stock.toInt()) : STOCK_UNTRACKED;
+    catalog.lowStock[productCount] = configServer.hasArg("new_low") ? max(0L, configServer.arg("new_low").toInt()) : config.lowStock;
     productCount++;
   }
-  saveProductsToSD();
+  catalogChanged();
+  writeSnapshot();
+  scheduleProductsSave();
   configServer.sendHeader("Location", "/");
   configServer.send(303);
 }
 
 
-////////////////////////////////
-// HTML AND CSS (UI/Frontend) //
-////////////////////////////////
-
-
-// product page
-String generateProductList() {
-  String content = "<div class='content-wrapper'>"; // Begin content wrapper
-
-  // repeated for the number of products in the shop
-  for (int i = 0; i < productCount; i++) {
-    content += "<div class='product'>";
-    content += "<p style='margin-top: 0;'><strong>" + String(products[i].name) + "</strong> (" + String(products[i].price, 2) + " €";
-    if (products[i].hasDeposit) content += " + 1 € Pfand";
-    content += ")</p>";
-    content += "<div class='row'><div class='left'>";
-    content += "<span>Anzahl: " + String(products[i].count) + "</span>";
-
-    // add product buttons
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 1)' style='background-color: green; color: white;'>+1</button>"; // +1 Button
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 2)' style='background-color: green; color: white;'>+2</button>"; // +2 Button
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 3)' style='background-color: green; color: white;'>+3</button>"; // +3 Button
-
-    content += "</div>";
-
-    // -1 button on the right side of the row
-    content += "<button onclick='sendAction(\"remove\", " + String(i) + ")' style='background-color: red; color: white;'>-1</button>";
+// reload config.txt without reboot
+void handleReloadConfig() {
+  loadConfigFromSD();
+  writeSnapshot(); // sales after this are booked with the new deposits
+  configServer.sendHeader("Location", "/");
+  configServer.send(303);
+}
 
-    content += "</div>"; // line end
-    content += "</div>"; // product block end
+// save the settings edited on the config page to config.txt and apply them
+void handleSaveSettings() {
+  unsigned long start = micros();
+  File file = SD.open("/config.txt", FILE_WRITE);
+  if (!file) {
+    error(4); // file error
+    configServer.send(500, "text/plain", "config.txt konnte nicht gespeichert werden");
+    return;
   }
+  file.print(configServer.arg("config"));
+  traceSd(SD_OP_CONFIG_WRITE, start, file.position());
+  file.close();
+  handleReloadConfig();
+}
 
-  // Footer with copyright
-  content += "<footer style='text-align: center; margin-top: 20px; font-size: 12px; color: #888;'>";
-  content += "&copy; 2025 Imanuel Fehse | Alle Rechte vorbehalten.";
-  // Link to the MIT license
-  content += "<br><a href='/license' style='color: #007BFF; text-decoration: none;'>MIT Lizenz</a>";
-  content += "</footer>";
-
-  content += "</div>"; // End content wrapper
 
-  // Add fixed footer container
-  content += "<div class='fixed-footer'>";
-  content += "<h3 class='bottom-interface'>" + String(calculateTotal(), 2) + " €<br>";
-  content += "<small class='bottom-interface'>(inkl. " + String(calculateDeposit(), 2) + " € Pfand)</small></h3>";
-  content += "<button class='bottom-interface' onclick='sendAction(\"clear\", -1)'>Warenkorb löschen</button>";
-  content += "<button class='bottom-interface' onclick='sendAction(\"checkout\", -1)'>Bestellung abschließen</button>"; // Add the "Bestellung abschließen" button
-  content += "</div>"; // End of footer container
+////////////////////////////////
+// HTML AND CSS (UI/Frontend) //
+////////////////////////////////
 
-  return content;
-}
 
 // configuration page HTML
-String generateConfigPage() {
+void generateConfigPage(ResponseStream& out) {
   // HTML template for the configuration page
   String html = R"rawliteral(
     <!DOCTYPE html>
@@ -606,14 +3245,24 @@ String generateConfigPage() {
   for (int i = 0; i < productCount; i++) {
     html += "<div class='product-config'>";
     html += "<label>Name </label>";
-    html += "<input class='input-field' type='text' name='name_" + String(i) + "' value='" + String(products[i].name) + "'><br>";
+    html += "<input class='input-field' type='text' name='name_" + String(i) + "' value='" + String(catalog.name[i]) + "'><br>";
     html += "<label>Preis </label>";
-    html += "<input class='input-field' type='number' step='0.01' name='price_" + String(i) + "' value='" + String(products[i].price, 2) + "'><br>";
+    html += "<input class='input-field' type='number' step='0.01' name='price_" + String(i) + "' value='" + String(catalog.price[i], 2) + "'><br>";
+    html += "<label>Kategorie </label>";
+    html += "<input class='input-field' type='text' list='categories' name='category_" + String(i) + "' value='" + String(catalog.category[i] == CATEGORY_NONE ? "" : categories[catalog.category[i]]) + "'><br>";
+    html += "<label>Bestand (leer = nicht zählen) </label>";
+    html += "<input class='input-field' type='number' min='0' name='stock_" + String(i) + "' value='" + stockText(i) + "'>";
+    html += "<input type='hidden' name='stock_shown_" + String(i) + "' value='" + stockText(i) + "'><br>";
+    html += "<label>Nachfüllen (+ Anzahl) </label>";
+    html += "<input class='input-field' type='number' name='restock_" + String(i) + "' placeholder='0'><br>";
+    html += "<label>Warnen ab Bestand </label>";
+    html += "<input class='input-field' type='number' min='0' name='low_" + String(i) + "' value='" + String(catalog.lowStock[i]) + "'><br>";
     html += "<div style='display: flex; justify-content: space-between; align-items: center;'>";
-    html += "<label>Pfand <input type='checkbox' name='deposit_" + String(i) + "'" + (products[i].hasDeposit ? " checked" : "") + "></label>";
+    html += "<label>Pfand <input type='checkbox' name='deposit_" + String(i) + "'" + (catalog.hasDeposit[i] ? " checked" : "") + "></label>";
     html += "<button type='button' style='background-color: red; color: white;' onclick='deleteProduct(" + String(i) + ")'>Produkt löschen</button>";
     html += "</div>"; // End of flex line
     html += "</div>"; // end of product config block
+    if (html.length() >= DEFLATE_OUT) out.write(html);
   }
 
   
@@ -621,9 +3270,19 @@ String generateConfigPage() {
   html += "<h2>Neues Produkt</h2>";
   html += "<label>Name</label><input class='input-field' type='text' name='new_name'><br>";
   html += "<label>Preis</label><input class='input-field' type='number' step='0.01' name='new_price'><br>";
+  html += "<label>Kategorie</label><input class='input-field' type='text' list='categories' name='new_category'><br>";
+  html += "<label>Bestand (leer = nicht zählen)</label><input class='input-field' type='number' min='0' name='new_stock'><br>";
+  html += "<label>Warnen ab Bestand</label><input class='input-field' type='number' min='0' name='new_low' value='" + String(config.lowStock) + "'><br>";
   html += "<label>Pfand<input type='checkbox' name='new_deposit'></label><br>";
   html += "<input type='submit' value='Speichern'></form>";
 
+  // existing categories as suggestions for the category fields
+  html += "<datalist id='categories'>";
+  for (int c = 0; c < categoryCount; c++) {
+    html += "<option value='" + String(categories[c]) + "'>";
+  }
+  html += "</datalist>";
+
   html += "<script>function deleteProduct(id){fetch('/deleteProduct?id='+id).then(()=>location.reload());}</script>"; // delete product script for button (references the function in the HTML))
 
   // Reset to default products button
@@ -631,6 +3290,24 @@ String generateConfigPage() {
   html += "<button type='submit' style='background-color: red; color: white;'>Zurücksetzen auf Standardprodukte</button>";
   html += "</form>";
 
+  // settings from config.txt
+  html += "<h2>Einstellungen (config.txt)</h2>";
+  if (configErrors.length() > 0 || pricingErrors.length() > 0) {
+    html += "<pre style='color: red;'>" + configErrors + pricingErrors + "</pre>";
+  }
+  html += "<form method='POST' action='/saveSettings'>";
+  html += "<textarea name='config' rows='16' style='width: 100%; box-sizing: border-box; font-family: monospace;'>";
+  unsigned long start = micros();
+  File file = SD.open("/config.txt");
+  if (file) {
+    html += file.readString();
+    traceSd(SD_OP_CONFIG_READ, start, file.size());
+    file.close();
+  }
+  html += "</textarea>";
+  html += "<input type='submit' value='Einstellungen speichern und übernehmen'></form>";
+  html += "<form action='/reloadConfig' method='post'><button type='submit'>config.txt neu laden</button></form>";
+
   // footer with copyright 
   html += "<footer style='text-align: center; margin-top: 20px; font-size: 12px; color: #888;'>";
   html += "&copy; 2025 Imanuel Fehse | Alle Rechte vorbehalten.";
@@ -638,7 +3315,7 @@ String generateConfigPage() {
   html += "<br><a href='/license' style='color: #007BFF; text-decoration: none;'>MIT Lizenz</a>";
   html += "</footer>";
   html += "</body></html>";
-  return html;
+  out.write(html);
 }
 
 // MIT License
@@ -666,7 +3343,6 @@ String getMITLicense() {
 // product page
 void handleRoot() {
   // HTML template for the product page
-  loadSalesFromSD(); // load sales from SD
   String html = R"rawliteral(
   <!DOCTYPE html>
   <html>
@@ -784,26 +3460,148 @@ void handleRoot() {
         margin-bottom: 70px; /* Make space for the fixed footer */
       }
 
+      .search {
+        width: 100%;
+        box-sizing: border-box;
+        padding: 8px;
+        margin-bottom: 7px;
+        font-size: 16px;
+        border-radius: 10px;
+        border: 1px solid #ccc;
+      }
+
+      .categories {
+        display: flex;
+        flex-wrap: wrap;
+        gap: 5px;
+        margin-bottom: 7px;
+      }
+
+      .categories .tab {
+        background-color: #888;
+        margin-left: 0;
+      }
+
+      .categories .tab.active {
+        background-color: #007BFF;
+      }
+
+      .product.low {
+        border-color: orange;
+      }
+
+      .product.soldout {
+        opacity: 0.4;
+      }
+
+      .stock-alert {
+        padding: 8px;
+        margin-bottom: 7px;
+        border-radius: 10px;
+        background-color: #ffe8cc;
+      }
+
+      .cashier {
+        display: flex;
+        justify-content: space-between;
+        align-items: center;
+        margin-bottom: 7px;
+      }
+
 
     </style>
     <script>
+      let category = -1; // selected category tab, -1 for all
+      let query = ''; // text in the search field
+
       function updateContent(){
-        fetch('/content').then(response => response.text()).then(html => {
+        fetch(`/content?cat=${category}&q=${encodeURIComponent(query)}`).then(response => response.text()).then(html => {
           document.getElementById('content').innerHTML = html;
         });
       }
 
+      function setCategory(c){
+        category = c;
+        updateContent();
+      }
+
+      // while typing, hide the products that don't match anymore, only reload if more products match than are shown
+      function search(text){
+        query = text.trim();
+        fetch(`/search?cat=${category}&q=${encodeURIComponent(query)}`).then(response => response.json()).then(ids => {
+          if (!ids.every(id => document.getElementById('p' + id))) {
+            updateContent();
+            return;
+          }
+          document.querySelectorAll('.product').forEach(el => {
+            el.style.display = ids.includes(Number(el.id.substring(1))) ? '' : 'none';
+          });
+        });
+      }
+
       function sendAction(action, id, quantity = 1){
         fetch(`/${action}?id=${id}&quantity=${quantity}`).then(() => updateContent());
       }
 
+      // the last order can be voided from the product page until the next one is booked
+      // other terminals sell too: reload when a product ran low or sold out
+      let stockVersion = -1;
+      function pollStock(){
+        fetch(`/stock`).then(response => response.text()).then(version => {
+          if (stockVersion >= 0 && Number(version) !== stockVersion) updateContent();
+          stockVersion = Number(version);
+        });
+      }
+
+      function checkout(){
+        fetch('/checkout').then(response => response.text().then(id => {
+          if (!response.ok) {
+            alert(id);
+            updateContent();
+            return;
+          }
+          const last = document.getElementById('lastOrder');
+          if (id !== '0') last.innerHTML = `Bestellung #${id} gebucht <button onclick='voidOrder(${id})' style='background-color: red; color: white;'>Stornieren</button>`;
+          updateContent();
+        }));
+      }
+
+      function voidOrder(id){
+        if (!confirm(`Bestellung #${id} stornieren?`)) return;
+        fetch(`/void?order=${id}`).then(response => response.text()).then(text => {
+          document.getElementById('lastOrder').innerHTML = text === 'OK' ? `Bestellung #${id} storniert` : text;
+          updateContent();
+        });
+      }
+
+      function openShift(){
+        const name = prompt('Name des Kassierers');
+        if (!name) return;
+        const cash = prompt('Bargeld in der Kasse bei Schichtbeginn (€)', '0');
+        fetch(`/openShift?cashier=${encodeURIComponent(name)}&cash=${cash || 0}`).then(() => updateContent());
+      }
+
+      function closeShift(){
+        const cash = prompt('Gezähltes Bargeld in der Kasse (€)');
+        if (cash === null) return;
+        fetch(`/closeShift?cash=${cash}`).then(response => response.text()).then(text => {
+          alert(text);
+          updateContent();
+        });
+      }
+
       window.onload = function() {
-        updateContent();
+        // the register has no clock, happy hour discounts need the time of day
+        fetch(`/clock?t=${Math.floor(Date.now() / 1000)}&tz=${new Date().getTimezoneOffset()}`).then(() => updateContent());
+        pollStock();
+        setInterval(pollStock, 3000);
       }
     </script>
   </head>
   <body>
     <h1>Kassensystem</h1>
+    <input class="search" type="search" placeholder="Produkt suchen..." oninput="search(this.value)">
+    <div id="lastOrder" class="cashier"></div>
     <div id="content">
       Lade Produkte...
     </div>
@@ -816,21 +3614,70 @@ void handleRoot() {
 
 // update content of product page when action was performed by client (add, remove, clear)
 void handleContent() {
+  ResponseStream out(server); // sent product by product, the whole list doesn't have to fit in RAM
+  out.begin(200, "text/html");
   String content = "<div class='content-wrapper'>"; // Begin content wrapper
 
+  // cart and cashier of this terminal
+  uint32_t terminal = server.client().remoteIP();
+  selectCart(terminal);
+  Shift* shift = findOpenShift(terminal);
+  content += "<div class='cashier'>";
+  if (shift) {
+    content += "<span>Kassierer: <strong>" + String(shift->cashier) + "</strong> (Schicht " + String(shift->id) + ", " + String(shift->revenue, 2) + " €)</span>";
+    content += "<button onclick='closeShift()' style='background-color: red; color: white;'>Schicht beenden</button>";
+  } else {
+    content += "<span>Kein Kassierer angemeldet</span>";
+    content += "<button onclick='openShift()' style='background-color: green; color: white;'>Schicht starten</button>";
+  }
+  content += "</div>";
+
+  // only the selected category and the products matching the search are rendered
+  int category = server.hasArg("cat") ? server.arg("cat").toInt() : -1;
+  String query = server.arg("q");
+  query.trim();
+  if (query.length() > 0) searchProducts(query.c_str());
+
+  // category tabs
+  if (categoryCount > 0) {
+    content += "<div class='categories'>";
+    content += "<button class='" + String(category < 0 ? "tab active" : "tab") + "' onclick='setCategory(-1)'>Alle</button>";
+    for (int c = 0; c < categoryCount; c++) {
+      content += "<button class='" + String(category == c ? "tab active" : "tab") + "' onclick='setCategory(" + String(c) + ")'>" + String(categories[c]) + "</button>";
+    }
+    content += "</div>";
+  }
+
+  // products running low or sold out, on every tab
+  String alert;
+  for (int i = 0; i < productCount; i++) {
+    StockState state = stockState(i);
+    if (state == STOCK_OK) continue;
+    if (alert.length() > 0) alert += ", ";
+    alert += String(catalog.name[i]) + (state == STOCK_OUT ? " (ausverkauft)" : " (noch " + String(catalog.stock[i]) + ")");
+  }
+  if (alert.length() > 0) content += "<div class='stock-alert'>Bestand: " + alert + "</div>";
+
   // repeated for the number of products in the shop
   for (int i = 0; i < productCount; i++) {
-    content += "<div class='product'>";
-    content += "<p style='margin-top: 0;'><strong>" + String(products[i].name) + "</strong> (" + String(products[i].price, 2) + " €";
-    if (products[i].hasDeposit) content += " + 1 € Pfand";
+    if (category >= 0 && catalog.category[i] != category) continue;
+    if (query.length() > 0 && !isSearchMatch(i)) continue;
+    StockState state = stockState(i);
+    int available = stockAvailable(i);
+    content += "<div class='product" + String(state == STOCK_OUT ? " soldout" : state == STOCK_LOW ? " low" : "") + "' id='p" + String(i) + "'>";
+    content += "<p style='margin-top: 0;'><strong>" + String(catalog.name[i]) + "</strong> (" + String(catalog.price[i], 2) + " €";
+    int32_t unit = unitPrice(i, max(1, catalog.count[i] - pricing.comboUsed[i])); // discount that applies right now
+    if (unit != pricing.price[i]) content += " → " + String(unit / 100.0f, 2) + " €";
+    if (catalog.hasDeposit[i]) content += " + " + String(catalog.deposit[i], 2) + " € Pfand";
     content += ")</p>";
     content += "<div class='row'><div class='left'>";
-    content += "<span>Anzahl: " + String(products[i].count) + "</span>";
+    content += "<span>Anzahl: " + String(catalog.count[i]) + "</span>";
 
-    // add product buttons
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 1)' style='background-color: green; color: white;'>+1</button>"; // +1 Button
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 2)' style='background-color: green; color: white;'>+2</button>"; // +2 Button
-    content += "<button onclick='sendAction(\"add\", " + String(i) + ", 3)' style='background-color: green; color: white;'>+3</button>"; // +3 Button
+    // add product buttons, disabled if not enough in stock
+    for (int q = 1; q <= 3; q++) {
+      content += "<button onclick='sendAction(\"add\", " + String(i) + ", " + String(q) + ")' style='background-color: green; color: white;'" + (available < q ? " disabled" : "") + ">+" + String(q) + "</button>";
+    }
+    if (catalog.stock[i] != STOCK_UNTRACKED) content += "<span>Bestand: " + String(catalog.stock[i]) + "</span>";
 
     content += "</div>";
 
@@ -839,6 +3686,7 @@ void handleContent() {
 
     content += "</div>"; // line end
     content += "</div>"; // product block end
+    if (content.length() >= DEFLATE_OUT) out.write(content);
   }
 
   // Footer with copyright
@@ -852,22 +3700,285 @@ void handleContent() {
 
   // Add fixed footer container
   content += "<div class='fixed-footer'>";
-  content += "<h3 class='bottom-interface'>" + String(calculateTotal(), 2) + " €<br>";
-  content += "<small class='bottom-interface'>(inkl. " + String(calculateDeposit(), 2) + " € Pfand)</small></h3>";
+  CartTotals totals = calculateTotals();
+  content += "<h3 class='bottom-interface'>" + String(totals.total, 2) + " €<br>";
+  content += "<small class='bottom-interface'>(inkl. " + String(totals.deposit, 2) + " € Pfand)</small>";
+  for (int c = 0; c < pricing.comboCount; c++) {
+    if (pricing.comboApplied[c] > 0) content += "<br><small class='bottom-interface'>" + String(pricing.comboApplied[c]) + "x " + String(config.combos[c].name) + "</small>";
+  }
+  if (totals.discount > 0.005f) content += "<br><small class='bottom-interface'>(" + String(totals.discount, 2) + " € Rabatt)</small>";
+  content += "</h3>";
   content += "<button class='bottom-interface' onclick='sendAction(\"clear\", -1)'>Warenkorb löschen</button>";
-  content += "<button class='bottom-interface' onclick='sendAction(\"checkout\", -1)'>Bestellung abschließen</button>"; // Add the "Bestellung abschließen" button
+  content += "<button class='bottom-interface' onclick='checkout()'>Bestellung abschließen</button>"; // Add the "Bestellung abschließen" button
   content += "</div>"; // End of footer container
 
-  server.send(200, "text/html", content);
+  out.write(content);
+  out.end();
+}
+
+// stock version, polled by the product page (only RAM, no SD access)
+void handleStock() {
+  server.send(200, "text/plain", String(stockVersion));
+}
+
+// time of day from the browser, for discounts with a time window
+void handleClock() {
+  if (!server.hasArg("t")) {
+    server.send(400, "text/plain", "t fehlt");
+    return;
+  }
+  shopClock.epoch = strtoul(server.arg("t").c_str(), nullptr, 10);
+  shopClock.setMillis = millis();
+  shopClock.tzOffset = server.arg("tz").toInt();
+  shopClock.set = true;
+  if (pricing.timed) repriceCart();
+  server.send(200, "text/plain", "OK");
+}
+
+// ids of the products matching the search text (and category), as JSON array
+void handleSearch() {
+  int category = server.hasArg("cat") ? server.arg("cat").toInt() : -1;
+  String query = server.arg("q");
+  query.trim();
+  if (query.length() > 0) searchProducts(query.c_str());
+
+  String json = "[";
+  for (int i = 0; i < productCount; i++) {
+    if (category >= 0 && catalog.category[i] != category) continue;
+    if (query.length() > 0 && !isSearchMatch(i)) continue;
+    if (json.length() > 1) json += ",";
+    json += String(i);
+  }
+  json += "]";
+  server.send(200, "application/json", json);
 }
 
 // Port 8080 configuration page
 void handleConfig() {
-  configServer.send(200, "text/html", generateConfigPage()); // send HTML to client
+  ResponseStream out(configServer);
+  out.begin(200, "text/html");
+  generateConfigPage(out); // sent to the client while it is generated
+  out.end();
+}
+
+
+
+
+
+#ifdef SHOPCALC_DIAGNOSTICS
+/////////////////
+// Diagnostics //
+/////////////////
+
+// cart total over n products: array of Product structs (old layout) vs. catalog columns
+void benchmarkCatalog() {
+  const int sizes[] = {50, 500, 2000};
+  const int runs = 100;
+  for (int n : sizes) {
+    Product* rows = (Product*)calloc(n, sizeof(Product));
+    int* count = (int*)calloc(n, sizeof(int));
+    float* price = (float*)calloc(n, sizeof(float));
+    float* deposit = (float*)calloc(n, sizeof(float));
+    if (rows && count && price && deposit) {
+      for (int i = 0; i < n; i++) {
+        rows[i].price = price[i] = (i % 7) * 0.5;
+        rows[i].hasDeposit = i % 3 == 0;
+        deposit[i] = rows[i].hasDeposit ? 1.0 : 0;
+        rows[i].count = count[i] = i % 4;
+      }
+
+      volatile float sink = 0;
+      unsigned long start = micros();
+      for (int r = 0; r < runs; r++) {
+        float total = 0;
+        float dep = 0;
+        for (int i = 0; i < n; i++) {
+          total += rows[i].count * rows[i].price;
+          if (rows[i].hasDeposit) total += rows[i].count * 1.0;
+        }
+        for (int i = 0; i < n; i++) {
+          if (rows[i].hasDeposit) dep += rows[i].count * 1.0;
+        }
+        sink = total + dep;
+      }
+      unsigned long rowMicros = micros() - start;
+
+      start = micros();
+      for (int r = 0; r < runs; r++) {
+        float net = 0;
+        float dep = 0;
+        for (int i = 0; i < n; i++) {
+          net += count[i] * price[i];
+          dep += count[i] * deposit[i];
+        }
+        sink = net + dep;
+      }
+      unsigned long columnMicros = micros() - start;
+      (void)sink;
+
+      Serial.println("[benchmarkCatalog] " + String(n) + " products: structs " + String(rowMicros / (float)runs, 2) + " us, columns " + String(columnMicros / (float)runs, 2) + " us per total");
+    } else {
+      Serial.println("[benchmarkCatalog] not enough memory for " + String(n) + " products");
+    }
+    free(rows);
+    free(count);
+    free(price);
+    free(deposit);
+  }
+}
+
+// search and product list at the largest catalog this build holds: the unused rows up to MAX_PRODUCTS
+// get made-up names for the test and are cleared again afterwards
+void benchmarkSearch() {
+  const char* words[] = {"Bier", "Cola", "Wasser", "Apfelschorle", "Bratwurst", "Pommes", "Kaffee", "Kuchen", "Wein", "Limo"};
+  int realCount = productCount;
+  for (int i = realCount; i < MAX_PRODUCTS; i++) {
+    Product product = {};
+    snprintf(product.name, sizeof(product.name), "%s %d", words[i % 10], i);
+    product.price = 1.5;
+    catalogSet(i, product);
+  }
+  productCount = MAX_PRODUCTS;
+
+  unsigned long start = micros();
+  buildSearchIndex();
+  Serial.println("[benchmarkSearch] " + String(productCount) + " products, " + String(searchEntryCount) + " words: index built in " + String(micros() - start) + " us, free heap " + String(ESP.getFreeHeap()) + " bytes");
+
+  const char* queries[] = {"b", "bier", "12", "xyz"};
+  const int runs = 100;
+  for (const char* query : queries) {
+    int found = 0;
+    start = micros();
+    for (int r = 0; r < runs; r++) found = searchProducts(query);
+    Serial.println("[benchmarkSearch] \"" + String(query) + "\": " + String(found) + " products in " + String((micros() - start) / (float)runs, 1) + " us");
+  }
+
+  // the whole list, a filtered render only writes the matching products of the same loop
+  String body;
+  responseCapture = &body;
+  start = micros();
+  handleContent();
+  unsigned long renderMicros = micros() - start;
+  responseCapture = nullptr;
+  Serial.println("[benchmarkSearch] /content with all products: " + String(body.length()) + " bytes in " + String(renderMicros) + " us (" + String(renderMicros / (float)productCount, 0) + " us per product)");
+
+  for (int i = realCount; i < MAX_PRODUCTS; i++) memset(catalog.name[i], 0, sizeof(catalog.name[i]));
+  productCount = realCount;
+  catalogChanged();
+}
+
+// time of a CPU clock change, the part of the wake-up latency that isn't the poll interval
+void benchmarkPower() {
+  const int runs = 10;
+  unsigned long start = micros();
+  for (int r = 0; r < runs; r++) {
+    setCpuFrequencyMhz(POWER_IDLE_MHZ);
+    setCpuFrequencyMhz(POWER_ACTIVE_MHZ);
+  }
+  Serial.println("[benchmarkPower] clock change " + String((micros() - start) / (2.0 * runs), 1) + " us");
+}
+
+// cost of recording one flight recorder event
+void benchmarkTrace() {
+  const int runs = 1000;
+  spillTrace(); // the test events overwrite the whole ring buffer
+  uint32_t head = recorder.spilled;
+  unsigned long start = micros();
+  for (int r = 0; r < runs; r++) {
+    traceEvent(TRACE_SD, SD_OP_TRACE, millis(), 0, 0, 0);
+  }
+  unsigned long elapsed = micros() - start;
+  recorder.head = head; // drop the test events (and the event of the spill above)
+  Serial.println("[benchmarkTrace] " + String(elapsed / (float)runs, 2) + " us per event");
 }
 
+// CPU time per KB against bytes saved for the compressed responses; compression pays off while the
+// Wi-Fi is slower than the break-even speed (the time to send the saved bytes is more than the CPU time)
+void benchmarkCompression() {
+  // the bodies the handlers really send, with the current products
+  String samples[3];
+  void (*handlers[3])() = {handleContent, handleConfig, handleExportSales};
+  const char* names[] = {"/content", "config page", "sales csv"};
+  for (int s = 0; s < 3; s++) {
+    responseCapture = &samples[s];
+    handlers[s]();
+  }
+  responseCapture = nullptr;
+  const int runs = 5;
+  for (int s = 0; s < 3; s++) {
+    size_t size = samples[s].length();
+    if (size == 0) continue;
+    unsigned long start = micros();
+    for (int r = 0; r < runs; r++) {
+      deflateBegin(nullptr); // only counted, not sent
+      for (size_t at = 0; at < size; at += DEFLATE_OUT) {
+        deflateWrite((const uint8_t*)samples[s].c_str() + at, min((size_t)DEFLATE_OUT, size - at));
+      }
+      deflateEnd();
+    }
+    float microsPerKB = (micros() - start) / (float)runs / (size / 1024.0f);
+    float savedPerKB = 1024.0f * (size - deflater.outSize) / size;
+    Serial.println("[benchmarkCompression] " + String(names[s]) + ": " + String(size) + " -> " + String(deflater.outSize) + " bytes, " + String(microsPerKB, 0) + " us/KB, pays off below " + String(savedPerKB / microsPerKB * 1000000 / 1024, 0) + " KB/s" + (config.gzip && size >= config.gzipMinSize ? ", compressed" : ", not compressed"));
+  }
+}
 
+// random carts with sample rules: the incrementally kept total has to match the brute force reference
+void selfTestPricing() {
+  if (productCount < 3) return;
+  static int savedCount[MAX_PRODUCTS];
+  static Config saved;
+  saved = config;
+  ShopClock savedClock = shopClock;
+  for (int i = 0; i < productCount; i++) savedCount[i] = catalog.count[i];
+
+  // sample rules on the first products: overlapping combos, a quantity discount and a happy hour over midnight
+  String a = catalog.name[0], b = catalog.name[1], c = catalog.name[2];
+  config.discountCount = 0;
+  config.comboCount = 0;
+  String errors;
+  parseConfigLine("discount." + a + "=-0.30;min=3", config, errors);
+  parseConfigLine("discount." + b + "=-0.50;time=22:00-02:00", config, errors);
+  if (catalog.category[2] != CATEGORY_NONE) parseConfigLine("discount." + String(categories[catalog.category[2]]) + "=-0.10", config, errors);
+  parseConfigLine("combo.AB=3.00:" + a + "," + b, config, errors);
+  parseConfigLine("combo.AAC=4.00:2*" + a + "," + c, config, errors);
+  compilePricing();
+
+  int mismatches = 0;
+  unsigned long incrementalMicros = 0, referenceMicros = 0;
+  const int steps = 2000;
+  for (int s = 0; s < steps; s++) {
+    if (s % 200 == 0) {
+      shopClock.set = true; // jump the clock around midnight
+      shopClock.epoch = 86400 - 7200 + random(0, 14400);
+      shopClock.setMillis = millis();
+      shopClock.tzOffset = 0;
+      repriceCart();
+    }
+    int i = random(0, min(productCount, 5));
+    int delta = catalog.count[i] > 0 && random(0, 3) == 0 ? -1 : (int)random(1, 4);
+    unsigned long start = micros();
+    catalog.count[i] += delta;
+    cartChanged(i, delta);
+    incrementalMicros += micros() - start;
+    start = micros();
+    int32_t reference = priceCartReference();
+    referenceMicros += micros() - start;
+    if (reference != pricing.net) {
+      if (mismatches++ < 5) Serial.println("[selfTestPricing] step " + String(s) + ": " + String(pricing.net) + " ct, reference " + String(reference) + " ct");
+    }
+    if (s % 50 == 49) {
+      for (int p = 0; p < productCount; p++) catalog.count[p] = 0;
+      repriceCart();
+    }
+  }
+  Serial.println("[selfTestPricing] " + String(mismatches) + " mismatches in " + String(steps) + " carts, " + String(incrementalMicros / (float)steps, 2) + " us per change, reference " + String(referenceMicros / (float)steps, 2) + " us");
 
+  config = saved;
+  shopClock = savedClock;
+  for (int i = 0; i < productCount; i++) catalog.count[i] = savedCount[i];
+  compilePricing();
+}
+#endif
 
 
 ////////////////////////
@@ -877,63 +3988,95 @@ void handleConfig() {
 
 // SETUP
 void setup() {
+  traceEvent(TRACE_BOOT, 0, millis(), 0, 0, 0); // before the SD operations of the boot
+
   // Onboard LED for status
   pinMode(LED_PIN, OUTPUT);
   digitalWrite(LED_PIN, LOW);
 
-  // Serial and Wifi Module
+  // Serial, SD card and config
   Serial.begin(115200);
-  WiFi.softAP(ssid, password);
-  Serial.println(String(color.blue) + "AP IP: " + WiFi.softAPIP().toString() + String(color.reset));
-  Serial.println(String(color.blue) + "AP SSID: " + ssid + String(color.reset));
   initSD(); // initialize SD card
+  loadConfigFromSD(); // WIFI and SD settings from config.txt
 
-  loadProductsFromSD();
-  if (productCount == 0) {
-    Serial.println("No products found on SD, loading default products. productCount: " + String(productCount));
-    for (int i = 0; i < defaultProductCount && i < MAX_PRODUCTS; i++) {
-      products[i] = defaultProducts[i];
+  // Wifi Module
+  WiFi.softAP(config.ssid, config.password);
+  Serial.println(String(color.blue) + "AP IP: " + WiFi.softAPIP().toString() + String(color.reset));
+  Serial.println(String(color.blue) + "AP SSID: " + config.ssid + String(color.reset));
+
+  // fast path: latest snapshot plus the journal written after it
+  if (loadSnapshot()) {
+    indexOrderLogTail(); // orders after the snapshot, before replay so voids in the journal find them
+    replayJournal();
+  } else {
+    // no snapshot yet (first boot or old firmware), load the CSV files and create one
+    loadProductsFromSD();
+    if (productCount == 0) {
+      Serial.println("No products found on SD, loading default products. productCount: " + String(productCount));
+      for (int i = 0; i < defaultProductCount && i < MAX_PRODUCTS; i++) {
+        catalogSet(i, defaultProducts[i]);
+      }
+      productCount = defaultProductCount;
+      if (!saveProductsToSD() || !saveSalesToSD()) error(4); // file error
     }
-    productCount = defaultProductCount;
-    saveProductsToSD();
-    saveSalesToSD();  
-  }
 
-  loadSalesFromSD(); 
+    loadSalesFromSD(); 
+    orderLog.epoch++; // orders in an existing orders.log can't be matched to these products
+    skipOrderLog();
+    writeSnapshot();
+  }
+  catalogChanged();
 
 
   // Port 80
-  server.on("/", handleRoot);
-  server.on("/add", handleAdd);
-  server.on("/remove", handleRemove);
-  server.on("/clear", handleClear);
-  server.on("/content", handleContent);
-  server.on("/submit", handleSubmit);
-  server.on("/sales", handleSalesOverview);
-  server.on("/resetSales", HTTP_POST, handleResetSales);
-  server.on("/exportSales", HTTP_POST, handleExportSales);
-  server.on("/license", []() {
+  server.on("/", scheduled(REQ_CHECKOUT, server, handleRoot));
+  server.on("/add", scheduled(REQ_CHECKOUT, server, handleAdd));
+  server.on("/remove", scheduled(REQ_CHECKOUT, server, handleRemove));
+  server.on("/clear", scheduled(REQ_CHECKOUT, server, handleClear));
+  server.on("/content", scheduled(REQ_CHECKOUT, server, handleContent));
+  server.on("/search", scheduled(REQ_CHECKOUT, server, handleSearch));
+  server.on("/submit", scheduled(REQ_CHECKOUT, server, handleSubmit));
+  server.on("/checkout", scheduled(REQ_CHECKOUT, server, handleSubmit)); // used by the "Bestellung abschließen" button
+  server.on("/void", scheduled(REQ_CHECKOUT, server, handleVoid));
+  server.on("/clock", scheduled(REQ_CHECKOUT, server, handleClock)); // time of day for happy hour discounts
+  server.on("/stock", traced(server, handleStock)); // polled by every open product page, not counted as activity so the register can go idle
+  server.on("/openShift", scheduled(REQ_CHECKOUT, server, handleOpenShift));
+  server.on("/closeShift", scheduled(REQ_CHECKOUT, server, handleCloseShift));
+  server.on("/sales", scheduled(REQ_REPORTING, server, handleSalesOverview));
+  server.on("/shifts", scheduled(REQ_REPORTING, server, handleShifts));
+  server.on("/order", scheduled(REQ_REPORTING, server, handleOrder));
+  server.on("/refund", HTTP_POST, scheduled(REQ_REPORTING, server, handleRefund));
+  server.on("/status", scheduled(REQ_REPORTING, server, handleStatus));
+  server.on("/resetSales", HTTP_POST, scheduled(REQ_ADMIN, server, handleResetSales));
+  server.on("/exportSales", HTTP_POST, scheduled(REQ_ADMIN, server, handleExportSales));
+  server.on("/license", traced(server, []() {
     String licenseText = getMITLicense();
     server.send(200, "text/plain", licenseText);
-  });
-  server.onNotFound([]() {
+  }));
+  server.onNotFound(traced(server, []() {
     server.send(404, "text/plain", "404 Not Found\nEither you typed Port/IP wrong or my code is shit... Might actually be my bad...\n\nBack to <a href='/'>home</a>");
-  });
+  }, "(not found)"));
 
 
   // Port 8080
-  configServer.on("/", handleConfig);
-  configServer.on("/saveConfig", HTTP_POST, handleSaveConfig);
-  configServer.on("/deleteProduct", handleDeleteProduct);
-  configServer.on("/resetProducts", HTTP_POST, handleResetProducts);
-  configServer.on("/license", []() {
+  configServer.on("/", scheduled(REQ_ADMIN, configServer, handleConfig));
+  configServer.on("/saveConfig", HTTP_POST, scheduled(REQ_ADMIN, configServer, handleSaveConfig));
+  configServer.on("/deleteProduct", scheduled(REQ_ADMIN, configServer, handleDeleteProduct));
+  configServer.on("/resetProducts", HTTP_POST, scheduled(REQ_ADMIN, configServer, handleResetProducts));
+  configServer.on("/saveSettings", HTTP_POST, scheduled(REQ_ADMIN, configServer, handleSaveSettings));
+  configServer.on("/reloadConfig", HTTP_POST, scheduled(REQ_ADMIN, configServer, handleReloadConfig));
+  configServer.on("/trace", scheduled(REQ_ADMIN, configServer, handleTrace));
+  configServer.on("/license", traced(configServer, []() {
     String licenseText = getMITLicense();
     configServer.send(200, "text/plain", licenseText);
-  });
-  configServer.onNotFound([]() {
+  }, ":8080/license"));
+  configServer.onNotFound(traced(configServer, []() {
     configServer.send(404, "text/plain", "404 Not Found\nEither you typed Port/IP wrong or my code is shit... Might actually be my bad...\n\nBack to <a href='/'>home</a>");
-  });
+  }, ":8080 (not found)"));
 
+  const char* headers[] = {"Accept-Encoding"}; // for gzip, the web server only keeps the headers it is asked for
+  server.collectHeaders(headers, 1);
+  configServer.collectHeaders(headers, 1);
   server.begin();       // launch product page server so client can request page
   configServer.begin(); // launch config page server so client can request page
   Serial.println(String(color.green) + "servers started successfully" + String(color.reset));
@@ -941,7 +4084,18 @@ void setup() {
   Serial.println("product page running on port 80");
   Serial.println("config page running on port 8080");
 
-  Serial.println("\n " + String(color.green) + "Setup complete." + String(color.reset));
+  sdStats.bootMillis = millis();
+  power.lastActivity = millis(); // stay at full clock for a moment after boot
+  traceEvent(TRACE_SETUP, 0, 0, sdStats.bootMillis * 1000, 0, 0);
+#ifdef SHOPCALC_DIAGNOSTICS
+  benchmarkCatalog();
+  benchmarkSearch();
+  benchmarkPower();
+  benchmarkTrace();
+  selfTestPricing();
+  benchmarkCompression();
+#endif
+  Serial.println("\n " + String(color.green) + "Setup complete after " + String(sdStats.bootMillis) + " ms." + String(color.reset));
   Serial.println("Waiting for client requests...\n");
 
 }
@@ -952,7 +4106,7 @@ void loop() {
   // Status LED, not blocking webservers so client action is not delayed
   unsigned long currentMillis = millis();
 
-  if (currentMillis - previousMillis >= interval) {
+  if (currentMillis - previousMillis >= config.blinkInterval) {
     previousMillis = currentMillis;
     digitalWrite(LED_PIN, HIGH);  // LED an
     ledOn = true;
@@ -964,7 +4118,16 @@ void loop() {
     ledOn = false;
   }
 
-  // Webservers looking for client requests
-  server.handleClient();        // product page client handler
-  configServer.handleClient();  // config page client handler
+  // Webservers looking for client requests, cashier taps before reports and config
+  powerGovern(); // full clock before a waiting client is served
+  scheduleRequests();
+
+  flushPendingSaves(); // write changes to SD once the flush window is over
+  if (journalSinceSnapshot >= SNAPSHOT_INTERVAL && (!snapshotFailing || millis() - snapshotFailedMillis >= config.flushWindow)) {
+    writeSnapshot(); // keeps the journal short, so boot stays fast
+  }
+  if (millis() - recorder.lastSpill >= TRACE_SPILL_INTERVAL || (recorder.head - recorder.spilled >= TRACE_EVENTS / 2 && !recorder.spillFailing)) {
+    spillTrace(); // flight recorder to SD
+  }
+  powerSleep(); // only when idle, the CPU halts until the next poll
 }
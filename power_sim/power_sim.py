@@ -0,0 +1,180 @@
+# Simulates the power governor of main.cpp on traffic traces and compares
+# the energy used with the extra delay of the taps (wake-up latency).
+#
+#   python power_sim.py                      built-in traces, default policies
+#   python power_sim.py --trace taps.txt     own trace, one request time in seconds per line
+#
+# The power figures are rough values for an ESP32-Dev in softAP mode with SD module,
+# measure your own board and pass them with --active-mw/--idle-mw/--sleep-mw.
+
+import argparse
+import os
+import random
+
+# governor settings, same meaning as in main.cpp / config.txt
+POLICIES = {
+    "off (old loop)": dict(idle_after=0, sleep_after=0, sleep_poll=20),
+    "default": dict(idle_after=5000, sleep_after=60000, sleep_poll=20),
+    "eager": dict(idle_after=1000, sleep_after=10000, sleep_poll=50),
+    "lazy": dict(idle_after=30000, sleep_after=300000, sleep_poll=10),
+}
+IDLE_POLL_MS = 1  # POWER_IDLE_POLL
+BUSY_RATE = 20  # POWER_BUSY_RATE, requests per minute
+SWITCH_MS = 0.05  # time to change the CPU clock (printed at boot with SHOPCALC_DIAGNOSTICS)
+STOCK_POLL_S = 3  # every open product page polls /stock
+POLL_SERVICE_MS = 3  # time at full clock to answer a stock poll
+POWER_BANK_WH = 10 * 3.7 * 0.85  # 10000 mAh power bank, 85% converter efficiency
+
+
+def event_trace(rng, hours=5.0):
+    """Festival evening: slow start, busy peak, slow end. Every tap is an action plus a content reload."""
+    profile = [(0.5, 5), (1.0, 40), (2.5, 90), (4.0, 60), (hours, 10)]  # (until hour, customers per hour)
+    times = []
+    t = 0.0
+    start = 0.0
+    for until, per_hour in profile:
+        t = start
+        while True:
+            t += rng.expovariate(per_hour / 3600.0)
+            if t >= until * 3600:
+                break
+            tap = t
+            for _ in range(rng.randint(2, 6) + 1):  # products and checkout
+                times += [tap, tap + 0.05]
+                tap += rng.uniform(0.4, 1.5)
+        start = until * 3600
+    return sorted(times), hours * 3600
+
+
+def quiet_trace(rng, hours=8.0):
+    """Daytime use: a few orders per hour."""
+    times = []
+    t = 0.0
+    while True:
+        t += rng.expovariate(4 / 3600.0)
+        if t >= hours * 3600:
+            break
+        tap = t
+        for _ in range(rng.randint(1, 4) + 1):
+            times += [tap, tap + 0.05]
+            tap += rng.uniform(0.5, 2.0)
+    return sorted(times), hours * 3600
+
+
+def steady_trace(rng, hours=2.0):
+    """Constant queue at the bar, one tap every few seconds."""
+    times = []
+    t = 0.0
+    while t < hours * 3600:
+        t += rng.uniform(1.0, 6.0)
+        times += [t, t + 0.05]
+    return times, hours * 3600
+
+
+def load_trace(path):
+    times = []
+    with open(path) as f:
+        for line in f:
+            line = line.split("#")[0].strip()
+            if line:
+                times.append(float(line))
+    times.sort()
+    return times, (times[-1] + 60 if times else 60)
+
+
+def simulate(times, duration, policy, power_mw, terminals, rng):
+    """Returns (energy in Wh, seconds per state, list of added latencies in ms)."""
+    idle_after = policy["idle_after"] / 1000.0
+    sleep_after = policy["sleep_after"] / 1000.0
+    sleep_poll = policy["sleep_poll"]
+    spent = {"active": 0.0, "idle": 0.0, "sleep": 0.0}
+    latencies = []
+
+    last = 0.0  # last request (the register starts at full clock)
+    minute = 0  # current request rate minute
+    minute_requests = 0
+    last_minute_requests = 0
+
+    def state_at(t):
+        if idle_after == 0 or max(minute_requests, last_minute_requests) >= BUSY_RATE or t - last < idle_after:
+            return "active"
+        return "idle" if t - last < sleep_after else "sleep"
+
+    def account(t0, t1):
+        # between two requests the state only depends on the time since the last one
+        if idle_after == 0 or max(minute_requests, last_minute_requests) >= BUSY_RATE:
+            spent["active"] += t1 - t0
+            return
+        bounds = {"active": (0, last + idle_after), "idle": (last + idle_after, last + sleep_after), "sleep": (last + sleep_after, t1)}
+        for state, (begin, end) in bounds.items():
+            spent[state] += max(0.0, min(t1, end) - max(t0, begin))
+
+    t = 0.0
+    for when in times + [duration]:
+        # minute boundaries change the request rate
+        while when >= (minute + 1) * 60:
+            account(t, (minute + 1) * 60)
+            t = (minute + 1) * 60
+            minute += 1
+            last_minute_requests = minute_requests
+            minute_requests = 0
+        account(t, when)
+        t = when
+        if when >= duration:
+            break
+        state = state_at(when)
+        if state != "active":
+            poll = IDLE_POLL_MS if state == "idle" else sleep_poll
+            latencies.append(rng.uniform(0, poll) + SWITCH_MS)  # next poll is somewhere in the sleep
+        else:
+            latencies.append(0.0)
+        last = when
+        minute_requests += 1
+
+    energy = sum(spent[s] * power_mw[s] for s in spent) / 1000.0 / 3600.0
+    # stock polls wake the CPU for a moment without counting as activity
+    polls = terminals * duration / STOCK_POLL_S
+    low_share = (spent["idle"] + spent["sleep"]) / duration
+    energy += polls * low_share * POLL_SERVICE_MS / 1000.0 * (power_mw["active"] - power_mw["idle"]) / 1000.0 / 3600.0
+    return energy, spent, latencies
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Energy vs. tap latency of the ShopCalc Pro power governor")
+    parser.add_argument("--trace", help="file with one request time (seconds) per line")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--terminals", type=int, default=2, help="product pages open (each polls /stock)")
+    parser.add_argument("--active-mw", type=float, default=480, help="240 MHz, loop spinning")
+    parser.add_argument("--idle-mw", type=float, default=360, help="80 MHz, loop sleeping 1 ms")
+    parser.add_argument("--sleep-mw", type=float, default=345, help="80 MHz, loop sleeping sleep_poll ms")
+    args = parser.parse_args()
+
+    power_mw = {"active": args.active_mw, "idle": args.idle_mw, "sleep": args.sleep_mw}
+    rng = random.Random(args.seed)
+    if args.trace:
+        traces = {os.path.basename(args.trace)[:9]: load_trace(args.trace)}
+    else:
+        traces = {"event": event_trace(rng), "quiet": quiet_trace(rng), "steady": steady_trace(rng)}
+
+    print(f"{'trace':<10}{'policy':<16}{'requests':>9}{'Wh':>8}{'avg mW':>8}{'active':>8}{'idle':>7}{'sleep':>7}"
+          f"{'+ms avg':>9}{'+ms p99':>9}{'+ms max':>9}{'bank h':>8}")
+    for name, (times, duration) in traces.items():
+        for policy_name, policy in POLICIES.items():
+            energy, spent, latencies = simulate(times, duration, policy, power_mw, args.terminals, random.Random(args.seed))
+            avg_mw = energy * 3600.0 * 1000.0 / duration
+            share = {s: 100.0 * spent[s] / duration for s in spent}
+            print(f"{name:<10}{policy_name:<16}{len(times):>9}{energy:>8.2f}{avg_mw:>8.0f}"
+                  f"{share['active']:>7.1f}%{share['idle']:>6.1f}%{share['sleep']:>6.1f}%"
+                  f"{sum(latencies) / max(1, len(latencies)):>9.2f}{percentile(latencies, 99):>9.2f}{max(latencies, default=0):>9.2f}"
+                  f"{POWER_BANK_WH / (avg_mw / 1000.0):>8.0f}")
+
+
+if __name__ == "__main__":
+    main()
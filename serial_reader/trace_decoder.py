@@ -0,0 +1,129 @@
+import argparse
+import struct
+import sys
+from datetime import datetime, timedelta
+
+# Decodes the flight recorder of ShopCalc Pro (trace.bin from http://192.168.4.1:8080/trace
+# or trace.old/trace.bin from the SD card) into a timeline and latency percentiles.
+#
+#   python trace_decoder.py trace.bin
+#   python trace_decoder.py trace.old trace.bin --slow 500 --boot "2025-07-04 17:02"
+
+TRACE_MAGIC = 0x52544353
+CHUNK = struct.Struct("<IHHII")  # magic, version, routeCount, eventCount, dropped
+EVENT = struct.Struct("<IIIIBBH")  # start ms, duration us, bytes, free heap, type, id, code
+ROUTE_NAME = 24
+
+TRACE_BOOT, TRACE_REQUEST, TRACE_SD, TRACE_POWER, TRACE_SETUP = 1, 2, 3, 4, 5
+SD_OPS = ["sales.csv", "products.csv", "snapshot", "journal", "order append", "order read", "order patch", "trace spill",
+          "sales.csv read", "products.csv read", "snapshot read", "journal replay", "config read", "config write",
+          "trace download"]
+POWER_STATES = ["active", "idle", "sleep"]
+
+
+def read_events(paths):
+    """Yields (boot, event dict) for all events of the files, boot counts the restarts seen."""
+    boot = 0
+    routes = []
+    for path in paths:
+        with open(path, "rb") as f:
+            data = f.read()
+        pos = 0
+        while pos + CHUNK.size <= len(data):
+            magic, version, route_count, event_count, dropped = CHUNK.unpack_from(data, pos)
+            if magic != TRACE_MAGIC:
+                print(f"{path}: no chunk at byte {pos}, rest of the file skipped", file=sys.stderr)
+                break
+            pos += CHUNK.size
+            if route_count:
+                routes = [data[pos + i * ROUTE_NAME:pos + (i + 1) * ROUTE_NAME].split(b"\0")[0].decode("utf-8", "replace")
+                          for i in range(route_count)]
+                pos += route_count * ROUTE_NAME
+            for _ in range(event_count):
+                if pos + EVENT.size > len(data):
+                    break  # cut off by a power loss
+                start, duration, size, heap, kind, ident, code = EVENT.unpack_from(data, pos)
+                pos += EVENT.size
+                if version < 2 and kind == TRACE_BOOT:
+                    kind = TRACE_SETUP  # version 1 only recorded the end of setup, its SD operations went to the boot before
+                    boot += 1
+                elif kind == TRACE_BOOT:
+                    boot += 1
+                yield boot, dict(start=start, duration=duration, bytes=size, heap=heap, type=kind, id=ident, code=code,
+                                 name=event_name(kind, ident, routes), dropped=dropped)
+
+
+def event_name(kind, ident, routes):
+    if kind == TRACE_REQUEST:
+        return routes[ident] if ident < len(routes) and routes[ident] else f"route {ident}"
+    if kind == TRACE_SD:
+        return "sd " + (SD_OPS[ident] if ident < len(SD_OPS) else str(ident))
+    if kind == TRACE_POWER:
+        return "power " + (POWER_STATES[ident] if ident < len(POWER_STATES) else str(ident))
+    return "setup" if kind == TRACE_SETUP else "boot"
+
+
+def format_time(ms, boot_time):
+    if boot_time:
+        return (boot_time + timedelta(milliseconds=ms)).strftime("%H:%M:%S.%f")[:-3]
+    seconds, millis = divmod(ms, 1000)
+    minutes, seconds = divmod(seconds, 60)
+    hours, minutes = divmod(minutes, 60)
+    return f"{hours:02d}:{minutes:02d}:{seconds:02d}.{millis:03d}"
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Timeline and latency percentiles of a ShopCalc Pro trace")
+    parser.add_argument("files", nargs="+", help="trace files, oldest first")
+    parser.add_argument("--slow", type=float, default=0, help="only show events taking at least this many ms")
+    parser.add_argument("--boot", help="wall clock time of the last boot (YYYY-MM-DD HH:MM), otherwise time since boot")
+    parser.add_argument("--no-timeline", action="store_true", help="only print the percentiles")
+    args = parser.parse_args()
+
+    events = list(read_events(args.files))
+    if not events:
+        print("no events")
+        return
+    last_boot = events[-1][0]
+    boot_time = datetime.strptime(args.boot, "%Y-%m-%d %H:%M") if args.boot else None
+
+    if not args.no_timeline:
+        print(f"{'boot':>4} {'time':<12} {'event':<24} {'code':>4} {'ms':>9} {'bytes':>8} {'heap':>8}")
+        for boot, e in events:
+            if e["type"] == TRACE_BOOT:
+                print(f"{boot:>4} {'':<12} --- boot ---")
+                continue
+            if e["type"] == TRACE_SETUP:
+                print(f"{boot:>4} {'':<12} --- setup took {e['duration'] / 1000:.0f} ms ---")
+                continue
+            if e["duration"] / 1000.0 < args.slow:
+                continue
+            when = format_time(e["start"], boot_time if boot == last_boot else None)
+            code = e["code"] if e["type"] in (TRACE_REQUEST, TRACE_POWER) else ""
+            print(f"{boot:>4} {when:<12} {e['name']:<24} {code:>4} {e['duration'] / 1000:>9.2f} {e['bytes']:>8} {e['heap']:>8}")
+        print()
+
+    # latency per route and SD operation
+    durations = {}
+    for _, e in events:
+        if e["type"] in (TRACE_REQUEST, TRACE_SD):
+            durations.setdefault(e["name"], []).append(e["duration"] / 1000.0)
+    print(f"{'event':<24} {'count':>7} {'p50 ms':>9} {'p90 ms':>9} {'p99 ms':>9} {'max ms':>9}")
+    for name, values in sorted(durations.items(), key=lambda item: -max(item[1])):
+        print(f"{name:<24} {len(values):>7} {percentile(values, 50):>9.2f} {percentile(values, 90):>9.2f} "
+              f"{percentile(values, 99):>9.2f} {max(values):>9.2f}")
+
+    dropped = events[-1][1]["dropped"]
+    heaps = [e["heap"] for _, e in events if e["heap"]]
+    print(f"\n{len(events)} events, {last_boot} boots, {dropped} events lost since the last boot (RAM buffer full)")
+    if heaps:
+        print(f"free heap: min {min(heaps)} bytes, last {heaps[-1]} bytes")
+
+
+if __name__ == "__main__":
+    main()